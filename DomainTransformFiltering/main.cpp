@@ -7,8 +7,22 @@
 * the domain of the filter function, and performs linear filtering
 * to the transfomed domain.
 *
-* usage: DomainTransformFiltering.exe [input_image] ([sigma_s] [sigma_r] [maxiter])
-* (last three arguments are optional)
+* usage: DomainTransformFiltering.exe [input_image] ([sigma_s] [sigma_r] [maxiter] [precision] [mode])
+* (last five arguments are optional)
+* precision "float" (default) runs the SIMD float filter, and "double"
+* the double precision reference.
+* mode "rf" (default) is the recursive filter, and "nc" and "ic" are the
+* normalized and interpolated convolutions (O(1) per pixel for any sigma_s,
+* so 3 iterations are usually enough).
+*
+* usage: DomainTransformFiltering.exe guide [joint image] [sigma_s] [sigma_r] [maxiter] [input images...]
+* filters every input (e.g. depth maps or masks) with the edges of the
+* joint image, whose transformed domain is computed only once.
+*
+* usage: DomainTransformFiltering.exe video [input video] [output pattern] ([sigma_s] [sigma_r] [maxiter] [mode] [buffers])
+* filters a video file or an image sequence (e.g. "in_%04d.png") with
+* decoding, filtering and encoding in separate threads, and writes the
+* frames to the PNG files of the output pattern (e.g. "out_%04d.png").
 *
 * This code is programmed by 'tatsy'. You can use this
 * code for any purpose (if necessary).
@@ -18,8 +32,15 @@
 ************************************************************/
 
 #include <iostream>
+#include <string>
 #include <vector>
+#include <cstring>
+#include <deque>
 #include <ctime>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <omp.h>
 using namespace std;
 
@@ -152,12 +173,628 @@ void domainTransformFilter(cv::Mat& img, cv::Mat& out, cv::Mat& joint, double si
 	}
 }
 
+// Float version of the recursive filter.
+// The recurrence is sequential along the filtering direction, so several
+// independent rows (horizontal pass) or columns (vertical pass) are copied
+// into a scratch buffer where each of them runs in its own SIMD lane.
+// The result differs from the double precision version above by less than
+// 1.0e-5 for [0, 1] images.
+const int lanes = 8;	// rows filtered together in the horizontal pass
+const int strip = 64;	// columns filtered together in the vertical pass
+
+// Forward and backward recursion over "n" steps of "L" contiguous lanes.
+// coef[i*L+k] is the feedback coefficient between the steps i and i+1.
+void recursiveFilterLanes(float* buf, const float* coef, int n, int L) {
+	for(int i=1; i<n; i++) {
+		float* cur = buf + i*L;
+		const float* prv = buf + (i-1)*L;
+		const float* p = coef + (i-1)*L;
+#if defined(_OPENMP) && _OPENMP >= 201307
+#pragma omp simd
+#endif
+		for(int k=0; k<L; k++) {
+			cur[k] += p[k] * (prv[k] - cur[k]);
+		}
+	}
+
+	for(int i=n-2; i>=0; i--) {
+		float* cur = buf + i*L;
+		const float* nxt = buf + (i+1)*L;
+		const float* p = coef + i*L;
+#if defined(_OPENMP) && _OPENMP >= 201307
+#pragma omp simd
+#endif
+		for(int k=0; k<L; k++) {
+			cur[k] += p[k] * (nxt[k] - cur[k]);
+		}
+	}
+}
+
+// Recursive filter for horizontal direction (float)
+// "lanes" rows are interleaved into the scratch buffer.
+// "ldct" is the log-form derivative of the transformed domain (see
+// DomainTransformGuide), so the coefficient is exp(ldct / sigma_H).
+void recursiveFilterHorizontalF(cv::Mat& out, const cv::Mat& ldct, double sigma_H) {
+	const int width  = out.cols;
+	const int height = out.rows;
+	const int dim    = out.channels();
+	const int L      = lanes * dim;
+	const float s    = (float)(1.0 / sigma_H);
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		vector<float> buf(width * L, 0.0f);
+		vector<float> coef(width * L, 0.0f);
+
+#ifdef _OPENMP
+#pragma omp for
+#endif
+		for(int y0=0; y0<height; y0+=lanes) {
+			const int n = min(lanes, height - y0);
+
+			// gather rows and their coefficients
+			for(int r=0; r<n; r++) {
+				const float* src = out.ptr<float>(y0+r);
+				const float* d   = ldct.ptr<float>(y0+r);
+				for(int x=0; x<width; x++) {
+					const float p = x < width-1 ? exp(d[x] * s) : 0.0f;
+					for(int c=0; c<dim; c++) {
+						buf[x*L + r*dim + c]  = src[x*dim+c];
+						coef[x*L + r*dim + c] = p;
+					}
+				}
+			}
+
+			recursiveFilterLanes(&buf[0], &coef[0], width, L);
+
+			// scatter filtered rows
+			for(int r=0; r<n; r++) {
+				float* dst = out.ptr<float>(y0+r);
+				for(int x=0; x<width; x++) {
+					for(int c=0; c<dim; c++) {
+						dst[x*dim+c] = buf[x*L + r*dim + c];
+					}
+				}
+			}
+		}
+	}
+}
+
+// Recursive filter for vertical direction (float)
+// Walking the columns of the image directly steps a whole image row per
+// pixel in both directions, which thrashes the cache and TLB of wide images.
+// Instead, a strip of "strip" adjacent columns is copied row by row into a
+// contiguous scratch buffer, filtered by the kernel of the horizontal pass,
+// and copied back, so the image is read and written once with whole lines.
+void recursiveFilterVerticalF(cv::Mat& out, const cv::Mat& ldct, double sigma_H) {
+	const int width  = out.cols;
+	const int height = out.rows;
+	const int dim    = out.channels();
+	const float s    = (float)(1.0 / sigma_H);
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		vector<float> buf(height * strip * dim, 0.0f);
+		vector<float> coef(height * strip * dim, 0.0f);
+
+#ifdef _OPENMP
+#pragma omp for
+#endif
+		for(int x0=0; x0<width; x0+=strip) {
+			const int n = min(strip, width - x0);
+			const int L = n * dim;
+
+			// gather the strip and its coefficients
+			for(int y=0; y<height; y++) {
+				memcpy(&buf[y*L], out.ptr<float>(y) + x0*dim, L * sizeof(float));
+				if(y < height-1) {
+					const float* d = ldct.ptr<float>(y) + x0;
+					for(int i=0; i<n; i++) {
+						const float p = exp(d[i] * s);
+						for(int c=0; c<dim; c++) {
+							coef[y*L + i*dim + c] = p;
+						}
+					}
+				}
+			}
+
+			recursiveFilterLanes(&buf[0], &coef[0], height, L);
+
+			for(int y=0; y<height; y++) {
+				memcpy(out.ptr<float>(y) + x0*dim, &buf[y*L], L * sizeof(float));
+			}
+		}
+	}
+}
+
+// Variants of the domain transform filter [Gastal and Oliveira 2011]
+// recursive filtering (RF), normalized convolution (NC) and interpolated convolution (IC)
+enum DTMode {
+	DT_RF,
+	DT_NC,
+	DT_IC
+};
+
+// Normalized convolution of one line.
+// "ct" are the domain coordinates of the "n" samples, and "in" and "out" hold
+// "dim" interleaved channels. every sample is the average of the samples
+// within [ct - r, ct + r], computed from the prefix sums "sum" ((n+1)*dim values).
+// the box bounds only move forward, so the cost is O(1) per sample for any r.
+void boxFilterNC(const double* ct, const float* in, float* out, double* sum, int n, int dim, double r) {
+	for(int c=0; c<dim; c++) {
+		sum[c] = 0.0;
+	}
+	for(int i=0; i<n; i++) {
+		for(int c=0; c<dim; c++) {
+			sum[(i+1)*dim+c] = sum[i*dim+c] + in[i*dim+c];
+		}
+	}
+
+	int l = 0;	// box is [l, u)
+	int u = 0;
+	for(int i=0; i<n; i++) {
+		while(ct[l] < ct[i] - r) l++;
+		while(u < n && ct[u] <= ct[i] + r) u++;
+		const double w = 1.0 / (u - l);
+		for(int c=0; c<dim; c++) {
+			out[i*dim+c] = (float)((sum[u*dim+c] - sum[l*dim+c]) * w);
+		}
+	}
+}
+
+// Integral of the linearly interpolated line from ct[0] to t, where
+// ct[k] <= t < ct[k+1]. the line is extended by its end values.
+inline double integralIC(const double* ct, const float* in, const double* area, int n, int dim, int k, int c, double t) {
+	if(t <= ct[0]) return (t - ct[0]) * in[c];
+	if(t >= ct[n-1]) return area[(n-1)*dim+c] + (t - ct[n-1]) * in[(n-1)*dim+c];
+	const double h = t - ct[k];
+	const double v = in[k*dim+c] + h / (ct[k+1] - ct[k]) * (in[(k+1)*dim+c] - in[k*dim+c]);
+	return area[k*dim+c] + 0.5 * h * (in[k*dim+c] + v);
+}
+
+// Interpolated convolution of one line.
+// every sample is the mean of the linearly interpolated line over [ct - r, ct + r],
+// computed from the prefix integrals "area" (n*dim values) at the knots.
+// "out" must not overlap "in".
+void boxFilterIC(const double* ct, const float* in, float* out, double* area, int n, int dim, double r) {
+	for(int c=0; c<dim; c++) {
+		area[c] = 0.0;
+	}
+	for(int k=1; k<n; k++) {
+		const double h = 0.5 * (ct[k] - ct[k-1]);
+		for(int c=0; c<dim; c++) {
+			area[k*dim+c] = area[(k-1)*dim+c] + h * (in[(k-1)*dim+c] + in[k*dim+c]);
+		}
+	}
+
+	int kl = 0;	// segments of the box bounds
+	int ku = 0;
+	for(int i=0; i<n; i++) {
+		const double tl = ct[i] - r;
+		const double tu = ct[i] + r;
+		while(kl < n-2 && ct[kl+1] <= tl) kl++;
+		while(ku < n-2 && ct[ku+1] <= tu) ku++;
+		for(int c=0; c<dim; c++) {
+			const double il = integralIC(ct, in, area, n, dim, kl, c, tl);
+			const double iu = integralIC(ct, in, area, n, dim, ku, c, tu);
+			out[i*dim+c] = (float)((iu - il) / (2.0 * r));
+		}
+	}
+}
+
+// Box filter of every row in the transformed domain (NC or IC).
+// the domain coordinates are the prefix sums of the derivatives dct = ldct / -sqrt(2).
+void boxFilterHorizontal(cv::Mat& out, const cv::Mat& ldct, double r, DTMode mode) {
+	const int width  = out.cols;
+	const int height = out.rows;
+	const int dim    = out.channels();
+	const double s   = -1.0 / sqrt(2.0);
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		vector<double> ct(width);
+		vector<double> sum((width + 1) * dim);
+		vector<float>  line(width * dim);
+
+#ifdef _OPENMP
+#pragma omp for
+#endif
+		for(int y=0; y<height; y++) {
+			const float* d = ldct.ptr<float>(y);
+			float* row = out.ptr<float>(y);
+			ct[0] = 0.0;
+			for(int x=1; x<width; x++) {
+				ct[x] = ct[x-1] + s * d[x-1];
+			}
+
+			memcpy(&line[0], row, width * dim * sizeof(float));
+			if(mode == DT_NC) {
+				boxFilterNC(&ct[0], &line[0], row, &sum[0], width, dim, r);
+			} else {
+				boxFilterIC(&ct[0], &line[0], row, &sum[0], width, dim, r);
+			}
+		}
+	}
+}
+
+// Box filter of every column in the transformed domain (NC or IC).
+// strips of "strip" columns are transposed into a scratch buffer, so that
+// each column is filtered as a contiguous line.
+void boxFilterVertical(cv::Mat& out, const cv::Mat& ldct, double r, DTMode mode) {
+	const int width  = out.cols;
+	const int height = out.rows;
+	const int dim    = out.channels();
+	const double s   = -1.0 / sqrt(2.0);
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		vector<double> ct(height * strip);
+		vector<double> sum((height + 1) * dim);
+		vector<float>  buf(height * strip * dim);
+		vector<float>  line(height * dim);
+
+#ifdef _OPENMP
+#pragma omp for
+#endif
+		for(int x0=0; x0<width; x0+=strip) {
+			const int n = min(strip, width - x0);
+
+			// transpose the strip and accumulate the domain coordinates
+			for(int i=0; i<n; i++) {
+				ct[i*height] = 0.0;
+			}
+			for(int y=0; y<height; y++) {
+				const float* src = out.ptr<float>(y) + x0*dim;
+				const float* d = y > 0 ? ldct.ptr<float>(y-1) + x0 : NULL;
+				for(int i=0; i<n; i++) {
+					for(int c=0; c<dim; c++) {
+						buf[(i*height + y)*dim + c] = src[i*dim+c];
+					}
+					if(d != NULL) {
+						ct[i*height + y] = ct[i*height + y-1] + s * d[i];
+					}
+				}
+			}
+
+			for(int i=0; i<n; i++) {
+				float* col = &buf[i*height*dim];
+				memcpy(&line[0], col, height * dim * sizeof(float));
+				if(mode == DT_NC) {
+					boxFilterNC(&ct[i*height], &line[0], col, &sum[0], height, dim, r);
+				} else {
+					boxFilterIC(&ct[i*height], &line[0], col, &sum[0], height, dim, r);
+				}
+			}
+
+			for(int y=0; y<height; y++) {
+				float* dst = out.ptr<float>(y) + x0*dim;
+				for(int i=0; i<n; i++) {
+					for(int c=0; c<dim; c++) {
+						dst[i*dim+c] = buf[(i*height + y)*dim + c];
+					}
+				}
+			}
+		}
+	}
+}
+
+// Transformed domain of a joint image, reusable to filter any number of
+// inputs (images, depth maps, masks, alpha mattes) with the same edges.
+// The derivatives are stored in log form, -sqrt(2) * (1 + sigma_s / sigma_r * |I'|),
+// so that the coefficient a^dct of every iteration is just exp(ldct / sigma_H).
+class DomainTransformGuide {
+public:
+	DomainTransformGuide(double sigma_s, double sigma_r)
+		: sigma_s(sigma_s), sigma_r(sigma_r) {
+	}
+
+	DomainTransformGuide(const cv::Mat& joint, double sigma_s, double sigma_r)
+		: sigma_s(sigma_s), sigma_r(sigma_r) {
+		setJoint(joint);
+	}
+
+	// (re)compute the transformed domain, reusing the buffers of the same size
+	void setJoint(const cv::Mat& joint) {
+		cv::Mat J = joint;
+		if(joint.depth() != CV_32F) {
+			joint.convertTo(J, CV_MAKETYPE(CV_32F, joint.channels()));
+		}
+
+		const int width  = J.cols;
+		const int height = J.rows;
+		const int dim    = J.channels();
+		const float ratio = (float)(sigma_s / sigma_r);
+		const float scale = (float)(-sqrt(2.0));
+
+		ldctx.create(height, width-1, CV_32FC1);
+		ldcty.create(height-1, width, CV_32FC1);
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for(int y=0; y<height; y++) {
+			const float* j0 = J.ptr<float>(y);
+			const float* j1 = J.ptr<float>(min(y+1, height-1));
+			float* dx = ldctx.ptr<float>(y);
+			float* dy = y < height-1 ? ldcty.ptr<float>(y) : NULL;
+			for(int x=0; x<width; x++) {
+				float accumx = 0.0f;
+				float accumy = 0.0f;
+				for(int c=0; c<dim; c++) {
+					if(x < width-1) accumx += abs(j0[(x+1)*dim+c] - j0[x*dim+c]);
+					accumy += abs(j1[x*dim+c] - j0[x*dim+c]);
+				}
+				if(x < width-1) dx[x] = scale * (1.0f + ratio * accumx);
+				if(dy != NULL) dy[x] = scale * (1.0f + ratio * accumy);
+			}
+		}
+	}
+
+	// filter "img" (any number of channels, same size as the joint image).
+	// NC and IC use a box filter of radius sqrt(3) * sigma_H in each iteration.
+	void filter(const cv::Mat& img, cv::Mat& out, int maxiter, DTMode mode=DT_RF) const {
+		assert(img.rows == ldcty.rows + 1 && img.cols == ldctx.cols + 1);
+		img.convertTo(out, CV_MAKETYPE(CV_32F, img.channels()));
+		for(int i=0; i<maxiter; i++) {
+			double sigma_H = sigma_s * sqrt(3.0) * pow(2.0, maxiter - i - 1) / sqrt(pow(4.0, maxiter) - 1.0);
+			if(mode == DT_RF) {
+				recursiveFilterHorizontalF(out, ldctx, sigma_H);
+				recursiveFilterVerticalF(out, ldcty, sigma_H);
+			} else {
+				boxFilterHorizontal(out, ldctx, sqrt(3.0) * sigma_H, mode);
+				boxFilterVertical(out, ldcty, sqrt(3.0) * sigma_H, mode);
+			}
+		}
+	}
+
+private:
+	cv::Mat ldctx, ldcty;
+	double sigma_s;
+	double sigma_r;
+};
+
+// Domain transform filtering (float)
+void domainTransformFilterF(cv::Mat& img, cv::Mat& out, cv::Mat& joint, double sigma_s, double sigma_r, int maxiter, DTMode mode=DT_RF) {
+	assert(img.depth() == CV_32F && joint.depth() == CV_32F);
+
+	DomainTransformGuide guide(joint, sigma_s, sigma_r);
+	guide.filter(img, out, maxiter, mode);
+}
+
+// Filter several inputs with the edges of one joint image
+int guideMain(int argc, char** argv) {
+	cv::Mat joint = cv::imread(argv[2], CV_LOAD_IMAGE_COLOR);
+	if(joint.empty()) {
+		cout << "Failed to load image \"" << argv[2] << "\"" << endl;
+		return -1;
+	}
+	joint.convertTo(joint, CV_32FC3, 1.0 / 255.0);
+
+	const double sigma_s = atof(argv[3]);
+	const double sigma_r = atof(argv[4]);
+	const int    maxiter = atoi(argv[5]);
+
+CLOCK_START
+	DomainTransformGuide guide(joint, sigma_s, sigma_r);
+	for(int i=6; i<argc; i++) {
+		// inputs keep their channels (e.g. depth maps and masks stay gray)
+		cv::Mat img = cv::imread(argv[i], -1);
+		if(img.empty() || img.size() != joint.size()) {
+			cout << "Failed to load image \"" << argv[i] << "\" of the joint image size" << endl;
+			continue;
+		}
+
+		// the filter is linear, so values are filtered in their own range
+		cv::Mat out;
+		guide.filter(img, out, maxiter);
+		out.convertTo(out, img.depth());
+
+		char filename[256];
+		sprintf(filename, "output_%d.png", i - 6);
+		cv::imwrite(filename, out);
+		cout << "  " << argv[i] << " -> " << filename << endl;
+	}
+CLOCK_END
+	return 0;
+}
 
 // Main function
+// Frame buffers of the video pipeline, which circulate between the stages
+// and are reused for every frame of the same size.
+struct Frame {
+	int index;
+	cv::Mat decoded;	// 8 bit frame from the decoder
+	cv::Mat input;		// float frame
+	cv::Mat output;		// filtered float frame
+	cv::Mat encoded;	// 8 bit filtered frame
+};
+
+// Queue of frames between two stages. It is bounded by the number of frame
+// buffers, so a slow stage makes the previous ones wait for free buffers.
+class FrameQueue {
+public:
+	FrameQueue()
+		: closed(false) {
+	}
+
+	void push(Frame* frame) {
+		{
+			lock_guard<mutex> lock(mtx);
+			frames.push_back(frame);
+		}
+		cond.notify_one();
+	}
+
+	// wait for a frame, or return NULL when the queue is closed and empty
+	Frame* pop() {
+		unique_lock<mutex> lock(mtx);
+		while(frames.empty() && !closed) {
+			cond.wait(lock);
+		}
+		if(frames.empty()) return NULL;
+		Frame* frame = frames.front();
+		frames.pop_front();
+		return frame;
+	}
+
+	void close() {
+		{
+			lock_guard<mutex> lock(mtx);
+			closed = true;
+		}
+		cond.notify_all();
+	}
+
+private:
+	deque<Frame*> frames;
+	bool closed;
+	mutex mtx;
+	condition_variable cond;
+};
+
+// Wall clock time in seconds (also without OpenMP, and steady across threads)
+double wallTime() {
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Busy time and frame count of a pipeline stage
+struct StageStats {
+	int frames;
+	double busy;
+};
+
+void printStage(const char* name, const StageStats& stats) {
+	printf("  %-7s %5d frames, %7.2f fps (busy %.2f sec)\n", name, stats.frames,
+		stats.busy > 0.0 ? stats.frames / stats.busy : 0.0, stats.busy);
+}
+
+// Filter a video or an image sequence with a pipeline of three threads:
+// decode (and convert to float), filter, and encode (PNG files of "pattern").
+int videoMain(int argc, char** argv) {
+	const string input   = argv[2];
+	const string pattern = argv[3];
+	const double sigma_s = argc <= 4 ? 25.0 : atof(argv[4]);
+	const double sigma_r = argc <= 5 ? 0.1  : atof(argv[5]);
+	const int    maxiter = argc <= 6 ? 3    : atoi(argv[6]);
+	const string mode    = argc <= 7 ? "rf" : argv[7];
+	const int    nFrames = argc <= 8 ? 4    : max(atoi(argv[8]), 2);
+
+	if(mode != "rf" && mode != "nc" && mode != "ic") {
+		cout << "Unknown mode \"" << mode << "\"" << endl;
+		return -1;
+	}
+	DTMode dtMode = mode == "nc" ? DT_NC : mode == "ic" ? DT_IC : DT_RF;
+
+	// image sequences are given by a pattern such as "frame_%04d.png"
+	cv::VideoCapture capture(input);
+	if(!capture.isOpened()) {
+		cout << "Failed to open video \"" << input << "\"" << endl;
+		return -1;
+	}
+
+	cout << "[ Parameters ]" << endl;
+	cout << "  * sigma_s = " << sigma_s << endl; 
+	cout << "  * sigma_r = " << sigma_r << endl; 
+	cout << "  * maxiter = " << maxiter << endl; 
+	cout << "  * mode    = " << mode << endl; 
+	cout << "  * buffers = " << nFrames << endl; 
+	cout << endl;
+
+	vector<Frame> pool(nFrames);
+	FrameQueue freeFrames, decoded, filtered;
+	for(int i=0; i<nFrames; i++) {
+		freeFrames.push(&pool[i]);
+	}
+
+	StageStats decodeStats = { 0, 0.0 };
+	StageStats filterStats = { 0, 0.0 };
+	StageStats encodeStats = { 0, 0.0 };
+	double start = wallTime();
+
+	thread decoder([&]() {
+		for(int index=0; ; index++) {
+			Frame* frame = freeFrames.pop();
+			double t = wallTime();
+			if(!capture.read(frame->decoded) || frame->decoded.empty()) {
+				break;
+			}
+			frame->index = index;
+			frame->decoded.convertTo(frame->input, CV_32F, 1.0 / 255.0);
+			decodeStats.busy += wallTime() - t;
+			decodeStats.frames++;
+			decoded.push(frame);
+		}
+		decoded.close();
+	});
+
+	thread filter([&]() {
+		DomainTransformGuide guide(sigma_s, sigma_r);
+		Frame* frame;
+		while((frame = decoded.pop()) != NULL) {
+			double t = wallTime();
+			guide.setJoint(frame->input);
+			guide.filter(frame->input, frame->output, maxiter, dtMode);
+			filterStats.busy += wallTime() - t;
+			filterStats.frames++;
+			filtered.push(frame);
+		}
+		filtered.close();
+	});
+
+	thread encoder([&]() {
+		Frame* frame;
+		while((frame = filtered.pop()) != NULL) {
+			double t = wallTime();
+			char filename[512];
+			snprintf(filename, sizeof(filename), pattern.c_str(), frame->index);
+			frame->output.convertTo(frame->encoded, CV_8U, 255.0);
+			cv::imwrite(filename, frame->encoded);
+			encodeStats.busy += wallTime() - t;
+			encodeStats.frames++;
+			freeFrames.push(frame);
+		}
+	});
+
+	decoder.join();
+	filter.join();
+	encoder.join();
+
+	const double total = wallTime() - start;
+	cout << "[ Throughput ]" << endl;
+	printStage("decode", decodeStats);
+	printStage("filter", filterStats);
+	printStage("encode", encodeStats);
+	printf("  %-7s %5d frames, %7.2f fps (%.2f sec)\n", "total", encodeStats.frames,
+		total > 0.0 ? encodeStats.frames / total : 0.0, total);
+	return 0;
+}
+
 int main(int argc, char** argv) {
+	// Filter a frame sequence in a pipeline
+	if(argc > 3 && string(argv[1]) == "video") {
+		return videoMain(argc, argv);
+	}
+
+	// Filter many inputs with one joint image
+	if(argc > 6 && string(argv[1]) == "guide") {
+		return guideMain(argc, argv);
+	}
+
 	// Check arguments
 	if(argc <= 1) {
-		cout << "usage: DomainTransformFiltering.exe [input_image] ([sigma_s] [sigma_r] [maxiter])" << endl;
+		cout << "usage: DomainTransformFiltering.exe [input_image] ([sigma_s] [sigma_r] [maxiter] [precision] [mode])" << endl;
+		cout << "       DomainTransformFiltering.exe guide [joint image] [sigma_s] [sigma_r] [maxiter] [input images...]" << endl;
+		cout << "       DomainTransformFiltering.exe video [input video] [output pattern] ([sigma_s] [sigma_r] [maxiter] [mode] [buffers])" << endl;
+		cout << "  precision: float (default), double" << endl;
+		cout << "  mode: rf (default), nc, ic (float only)" << endl;
 		return -1;
 	}
 
@@ -168,24 +805,55 @@ int main(int argc, char** argv) {
 		return -1;
 	}
 
-	// change depth
-	img.convertTo(img, CV_64FC3, 1.0 / 255.0);
-
 	// Parameter set
-	const double sigma_s = argc <= 2 ? 25.0 : atof(argv[2]);
-	const double sigma_r = argc <= 3 ? 0.1  : atof(argv[3]);
-	const int    maxiter = argc <= 4 ? 10   : atoi(argv[4]);
+	const double sigma_s   = argc <= 2 ? 25.0 : atof(argv[2]);
+	const double sigma_r   = argc <= 3 ? 0.1  : atof(argv[3]);
+	const int    maxiter   = argc <= 4 ? 10   : atoi(argv[4]);
+	const string precision = argc <= 5 ? "float" : argv[5];
+	const string mode      = argc <= 6 ? "rf" : argv[6];
 
 	cout << "[ Parameters ]" << endl;
-	cout << "  * sigma_s = " << sigma_s << endl; 
-	cout << "  * sigma_r = " << sigma_r << endl; 
-	cout << "  * maxiter = " << maxiter << endl; 
+	cout << "  * sigma_s   = " << sigma_s << endl; 
+	cout << "  * sigma_r   = " << sigma_r << endl; 
+	cout << "  * maxiter   = " << maxiter << endl; 
+	cout << "  * precision = " << precision << endl; 
+	cout << "  * mode      = " << mode << endl; 
 	cout << endl;
 
+	DTMode dtMode;
+	if(mode == "rf") {
+		dtMode = DT_RF;
+	} else if(mode == "nc") {
+		dtMode = DT_NC;
+	} else if(mode == "ic") {
+		dtMode = DT_IC;
+	} else {
+		cout << "Unknown mode \"" << mode << "\"" << endl;
+		return -1;
+	}
+	if(precision == "double" && dtMode != DT_RF) {
+		cout << "NC and IC modes are available only in float precision" << endl;
+		return -1;
+	}
+
+	// change depth
+	if(precision == "double") {
+		img.convertTo(img, CV_64FC3, 1.0 / 255.0);
+	} else if(precision == "float") {
+		img.convertTo(img, CV_32FC3, 1.0 / 255.0);
+	} else {
+		cout << "Unknown precision \"" << precision << "\"" << endl;
+		return -1;
+	}
+
 	// Call domain transform filter
 CLOCK_START
 	cv::Mat out;
-	domainTransformFilter(img, out, img, sigma_s, sigma_r, maxiter);
+	if(precision == "double") {
+		domainTransformFilter(img, out, img, sigma_s, sigma_r, maxiter);
+	} else {
+		domainTransformFilterF(img, out, img, sigma_s, sigma_r, maxiter, dtMode);
+	}
 CLOCK_END
 
 	// Show results
@@ -5,9 +5,30 @@
 * This paper proposes an mehod that locally modifies coefficients
 * of laplacian filtered images by several remapping functions.
 *
-* usage: LocalLaplacianFilter.exe [input_image] ([sigma_r] [max level] [alpha] [tau])
-* (Last four arguments are optional. Please refer the original
+* usage: LocalLaplacianFilter.exe [input_image] ([sigma_r] [max level] [alpha] [tau] [mode] [samples] [curve] [beta] [color])
+* (Last nine arguments are optional. Please refer the original
 * paper for the detail of the input arguments )
+* mode "exact" (default) computes every coefficient from its own remapped
+* window as in the original paper, and "fast" uses the sampled remapping of
+* [Aubry et al. 2014] with [samples] intensity levels. for one channel
+* ("lum") fast converges to exact as the samples increase, but for "rgb"
+* it remaps the channels independently and stays a different filter.
+* curve "detail" (default) manipulates details with alpha and tau,
+* and "tone" also compresses large edges by [beta].
+* color "rgb" (default) filters the color image, and "lum" filters only
+* the log-luminance (sigma_r in log units) and restores color by ratio.
+*
+* usage: LocalLaplacianFilter.exe tiled [input ppm] [output pfm] [memory MB] ([sigma_r] ...)
+* filters a binary PPM that does not fit in memory tile by tile, and writes
+* the float result to a PFM. the result is identical to the in-memory one.
+*
+* usage: LocalLaplacianFilter.exe sweep [input image] [settings file] ([max level] [mode] [samples] [curve] [color])
+* filters the image with every "sigma_r alpha tau [beta]" line of the
+* settings file, sharing the gaussian pyramids, and saves sweep_###.png.
+*
+* usage: LocalLaplacianFilter.exe check
+* compares the tabulated remapping function with the direct curves,
+* and the fast filter with the exact one.
 * 
 * This code is programmed by 'tatsy'. You can use this
 * code for any purpose (if necessary).
@@ -17,6 +38,12 @@
 ************************************************************/
 
 #include <iostream>
+#include <string>
+#include <vector>
+#include <ctime>
+#include <cstdio>
+#include <cfloat>
+#include <cctype>
 using namespace std;
 
 #ifdef _OPENMP
@@ -24,6 +51,14 @@ using namespace std;
 #endif
 
 #include <opencv2/opencv.hpp>
+
+double wallTime() {
+#ifdef _OPENMP
+	return omp_get_wtime();
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
  
 double fd(double d, double tau, double alpha) {
 	return tau * pow(d, alpha) + (1.0 - tau) * d;
@@ -33,70 +68,175 @@ double fe(double d) {
 	return d;
 }
 
-double sign(double d) {
-	if(d > 0.0) return 1.0;
-	if(d < 0.0) return -1.0;
-	return 0.0;
+// parameters of the remapping curves
+struct RemapParams {
+	double sigma_r;
+	double alpha;
+	double tau;
+	double beta;
+};
+
+// remapping curves return the remapped distance from g0 for distance d.
+// "detail" is the curve of the paper (fd inside sigma_r, fe outside), and
+// "tone" also compresses the edges larger than sigma_r by beta.
+typedef double (*RemapCurve)(double d, const RemapParams& p);
+
+double detailCurve(double d, const RemapParams& p) {
+	if(d <= p.sigma_r) return p.sigma_r * fd(d / p.sigma_r, p.tau, p.alpha);
+	return fe(d - p.sigma_r) + p.sigma_r;
 }
 
-// remapping function
-void remapping(cv::Mat& R, cv::Vec3f g0, double sigma_r, double tau, double alpha) {
-	for(int y=0; y<R.rows; y++) {
-		for(int x=0; x<R.cols; x++) {
-			cv::Vec3f i = R.at<cv::Vec3f>(y, x);
-			cv::Vec3f v = i - g0;
-			double nrm = cv::norm(v);
-			if(nrm != 0.0) v = v / nrm;
-			if(nrm <= sigma_r) {
-				R.at<cv::Vec3f>(y, x) = g0 + v * sigma_r * fd(nrm / sigma_r, tau, alpha);
-			} else {
-				R.at<cv::Vec3f>(y, x) = g0 + v * (fe(nrm - sigma_r) + sigma_r);
+double toneCurve(double d, const RemapParams& p) {
+	if(d <= p.sigma_r) return p.sigma_r * fd(d / p.sigma_r, p.tau, p.alpha);
+	return p.beta * fe(d - p.sigma_r) + p.sigma_r;
+}
+
+// remapping curve of the given name ("detail" or "tone"), or NULL if unknown
+RemapCurve findCurve(const string& name) {
+	if(name == "detail") return detailCurve;
+	if(name == "tone") return toneCurve;
+	return NULL;
+}
+
+// remapping function tabulated for the current parameters.
+// the table stores curve(d) on [0, maxDist], so that a pixel is remapped by
+// g0 + (i - g0) * curve(|i - g0|) / |i - g0| with a single linearly interpolated
+// lookup and no branch, which vectorizes over whole rows.
+// for alpha < 1 the curve has an unbounded slope at 0, so the table is sampled
+// uniformly in u = (d / maxDist)^(1 / 2^warp) with 1 / 2^warp <= alpha (warp <= 2).
+// then curve is smooth in u near 0 and the lookup only needs "warp" square roots.
+class RemapTable {
+public:
+	RemapTable(RemapCurve curve, const RemapParams& params, double maxDist, int samples=4096) {
+		warp = 0;
+		while(warp < 2 && params.alpha < 1.0 / (1 << warp)) warp++;
+		scale = (float)(1.0 / maxDist);
+		limit = (float)maxDist;
+		last  = (float)samples;
+		c.resize(samples+2);
+		for(int k=0; k<=samples+1; k++) {
+			double d = maxDist * pow((double)k / samples, 1 << warp);
+			c[k] = (float)curve(d, params);
+		}
+	}
+
+	// remap a 3 channel window around g0 (color distance)
+	void apply(cv::Mat& R, const cv::Vec3f& g0) const {
+		const float* t = &c[0];
+		for(int y=0; y<R.rows; y++) {
+			float* p = R.ptr<float>(y);
+			const int n = R.cols;
+			#if defined(_OPENMP) && _OPENMP >= 201307
+			#pragma omp simd
+			#endif
+			for(int x=0; x<n; x++) {
+				float d0 = p[3*x+0] - g0[0];
+				float d1 = p[3*x+1] - g0[1];
+				float d2 = p[3*x+2] - g0[2];
+				float d  = min(sqrt(d0 * d0 + d1 * d1 + d2 * d2), limit);
+				float r  = lookup(t, d) / max(d, FLT_MIN);
+				p[3*x+0] = g0[0] + d0 * r;
+				p[3*x+1] = g0[1] + d1 * r;
+				p[3*x+2] = g0[2] + d2 * r;
+			}
+		}
+	}
+
+	// remap a single channel image around g0
+	void apply(cv::Mat& R, float g0) const {
+		const float* t = &c[0];
+		for(int y=0; y<R.rows; y++) {
+			float* p = R.ptr<float>(y);
+			const int n = R.cols;
+			#if defined(_OPENMP) && _OPENMP >= 201307
+			#pragma omp simd
+			#endif
+			for(int x=0; x<n; x++) {
+				float d  = p[x] - g0;
+				float ad = min(abs(d), limit);
+				float r  = lookup(t, ad) / max(ad, FLT_MIN);
+				p[x] = g0 + d * r;
 			}
 		}
 	}
+
+private:
+	// linearly interpolated curve(d) for d in [0, maxDist]
+	float lookup(const float* t, float d) const {
+		float u = d * scale;
+		for(int k=0; k<warp; k++) u = sqrt(u);
+		float f = u * last;
+		int   i = (int)f;
+		return t[i] + (f - i) * (t[i+1] - t[i]);
+	}
+
+	vector<float> c;
+	int   warp;
+	float scale;
+	float limit;
+	float last;
+};
+
+// construct gaussian pyramid.
+// plain pyrDown, the same decomposition as the per-pixel windows of the
+// reference filter, so that both filters reconstruct the input exactly
+// for the identity remapping.
+void gaussianPyramid(cv::Mat& img, vector<cv::Mat>& pyr, int maxLevel) {
+	pyr.resize(maxLevel+1);
+	img.convertTo(pyr[0], CV_32F);
+	for(int level=1; level<=maxLevel; level++) {
+		cv::pyrDown(pyr[level-1], pyr[level]);
+	}
 }
 
-// main function
-int main(int argc, char** argv) {
-	if(argc <= 1) {
-		cout << "usage: LocalLaplacianFilter.exe [input image] ([sigma_r] [max level] [alpha] [tau])" << endl;
-		return -1;
+// reconstruct image from the top of gaussian pyramid and laplacian coefficients
+void reconstruct(cv::Mat& top, vector<cv::Mat>& laplacePyramid, cv::Mat& res) {
+	cv::Mat tmp;
+	top.convertTo(res, CV_32F);
+	for(int level=(int)laplacePyramid.size()-1; level>=0; level--) {
+		cv::pyrUp(res, tmp, laplacePyramid[level].size());
+		res = tmp + laplacePyramid[level];
 	}
+}
 
-	cv::Mat img = cv::imread(argv[1], CV_LOAD_IMAGE_COLOR);
-	if(img.empty()) {
-		cout << "Failed to load file \"" << argv[1] << "\"" << endl;
-		return -1;
+// per-thread scratch buffers for the per-pixel pyramids of one level.
+// every buffer is allocated once for the largest window, and ROI headers of
+// the needed size are handed to OpenCV, so no allocation happens per pixel.
+struct LLFWorkspace {
+	vector<cv::Mat> down;	// remapped window and its downsampled levels
+	cv::Mat coarse;			// one more pyrDown of the deepest level
+	cv::Mat subR;			// pyrUp of "coarse"
+	cv::Mat lap;			// laplacian of the deepest level
+};
+
+void allocateWorkspace(LLFWorkspace& ws, int level, int size, int dim) {
+	const int type = CV_MAKETYPE(CV_32F, dim);
+	int n = size;
+	ws.down.resize(level+1);
+	ws.down[0].create(n, n, type);
+	for(int sublev=1; sublev<=level; sublev++) {
+		n = (n + 1) / 2;
+		ws.down[sublev].create(n, n, type);
 	}
+	ws.coarse.create((n + 1) / 2, (n + 1) / 2, type);
+	ws.subR.create(n, n, type);
+	ws.lap.create(n, n, type);
+}
 
+// local laplacian filter (reference).
+// every coefficient is computed from the pyramid of its own remapped window.
+// "img" is either a color image or a single channel (e.g. log-luminance),
+// and "gaussPyramid" is its gaussian pyramid.
+void localLaplacianFilter(cv::Mat& img, vector<cv::Mat>& gaussPyramid, cv::Mat& res, int maxLevel, const RemapTable& remap) {
 	const int width  = img.cols;
 	const int height = img.rows;
 	const int dim    = img.channels();
-	img.convertTo(img, CV_32F, 1.0 / 255.0);
 
-	// initial parameter values
-	const double sigma_r  = argc > 2 ? atof(argv[2]) : 0.2;
-	const int    maxLevel = argc > 3 ? atoi(argv[3]) : 3;
-	const double alpha    = argc > 4 ? atof(argv[4]) : 4.0;
-	const double tau      = argc > 5 ? atof(argv[5]) : 0.8;
-
-	// stdout info.
-	printf("*** Local Laplacian Filter ***\n");
-	printf("  sigma_r   = %f\n", sigma_r);
-	printf("  max level = %d\n", maxLevel);
-	printf("  alpha     = %f\n", alpha);
-	printf("  tau       = %f\n", tau);
-	printf("\n");	
-	
-	// construct gaussian pyramid
-	cv::Mat tmp;
-	double sigma = 2.0;
-	vector<cv::Mat> gaussPyramid(maxLevel+1);
-	img.convertTo(gaussPyramid[0], CV_32F);
-	for(int level=1; level<=maxLevel; level++) {
-		cv::GaussianBlur(gaussPyramid[level-1], tmp, cv::Size(), sigma);
-		cv::pyrDown(tmp, gaussPyramid[level]);
-	}
+	#ifdef _OPENMP
+	vector<LLFWorkspace> workspaces(omp_get_max_threads());
+	#else
+	vector<LLFWorkspace> workspaces(1);
+	#endif
 
 	// construct laplacian pyramid and remap its coefficients
 	vector<cv::Mat> laplacePyramid(maxLevel);
@@ -104,10 +244,24 @@ int main(int argc, char** argv) {
 		printf("  Process Lv. %d ...\n", level);
 		laplacePyramid[level] = cv::Mat::zeros(gaussPyramid[level].size(), CV_MAKETYPE(CV_32F, dim));
 
+		// windows start on the grid of the coarsest level they are reduced to,
+		// so that their pyramids sample the same pixels as the global one
+		const int align = 2 << level;
+		const int Kmax  = 3 * ((4 << level) - 1);
+		for(int t=0; t<(int)workspaces.size(); t++) {
+			allocateWorkspace(workspaces[t], level, 2 * Kmax + align, dim);
+		}
+
 		#ifdef _OPENMP
 		#pragma omp parallel for
 		#endif
 		for(int y=0; y<gaussPyramid[level].rows; y++) {
+			#ifdef _OPENMP
+			LLFWorkspace& ws = workspaces[omp_get_thread_num()];
+			#else
+			LLFWorkspace& ws = workspaces[0];
+			#endif
+
 			for(int x=0; x<gaussPyramid[level].cols; x++) {
 				int rx = x;
 				int ry = y;
@@ -121,47 +275,690 @@ int main(int argc, char** argv) {
 				}
 
 				K = 3 * (K - 1);
-				int cx = max(0, rx - K);
-				int cy = max(0, ry - K);
+				int cx = max(0, (rx - K) / align * align);
+				int cy = max(0, (ry - K) / align * align);
 				int bx = min(width-1, rx + K);
 				int by = min(height-1, ry + K);
+				int w  = bx - cx + 1;
+				int h  = by - cy + 1;
 
-				cv::Mat R, tmp;
-				tmp = img(cv::Rect(cx, cy, bx-cx+1, by-cy+1));
-				tmp.convertTo(R, CV_32F);
-				cv::Vec3f g0 = gaussPyramid[level].at<cv::Vec3f>(y, x);
-				remapping(R, g0, sigma_r, tau, alpha);
+				cv::Mat R = ws.down[0](cv::Rect(0, 0, w, h));
+				img(cv::Rect(cx, cy, w, h)).copyTo(R);
+				if(dim == 3) {
+					remap.apply(R, gaussPyramid[level].at<cv::Vec3f>(y, x));
+				} else {
+					remap.apply(R, gaussPyramid[level].at<float>(y, x));
+				}
 
 				for(int sublev=0; sublev<level; sublev++) {
-					cv::pyrDown(R, tmp);
-					tmp.convertTo(R, CV_32F);
+					w = (w + 1) / 2;
+					h = (h + 1) / 2;
+					cv::Mat next = ws.down[sublev+1](cv::Rect(0, 0, w, h));
+					cv::pyrDown(R, next, next.size());
+					R = next;
 				}
 
-				cv::Mat subR;
-				cv::pyrDown(R, tmp);
-				cv::pyrUp(tmp, subR, R.size());
-				cv::Mat L = R - subR;
-				
-				for(int sublev=0; sublev<level; sublev++) {
-					cv::pyrUp(L, tmp);
-					tmp.convertTo(L, CV_32F);
+				cv::Mat coarse = ws.coarse(cv::Rect(0, 0, (w + 1) / 2, (h + 1) / 2));
+				cv::Mat subR   = ws.subR(cv::Rect(0, 0, w, h));
+				cv::Mat L      = ws.lap(cv::Rect(0, 0, w, h));
+				cv::pyrDown(R, coarse, coarse.size());
+				cv::pyrUp(coarse, subR, subR.size());
+				cv::subtract(R, subR, L);
+
+				// the coefficient is read at this level, where the aligned window
+				// maps (x, y) to a whole pixel
+				int lx = x - (cx >> level);
+				int ly = y - (cy >> level);
+				if(dim == 3) {
+					laplacePyramid[level].at<cv::Vec3f>(y, x) = L.at<cv::Vec3f>(ly, lx);
+				} else {
+					laplacePyramid[level].at<float>(y, x) = L.at<float>(ly, lx);
 				}
-				
-				int dx = cx - (rx - K);
-				int dy = cy - (ry - K);
-				laplacePyramid[level].at<cv::Vec3f>(y, x) = L.at<cv::Vec3f>(K+1-dy, K+1-dx);
 			}
 		}
 	}
-	printf("  Finish!\n\n");
 
 	// reconstruct resulting image from laplacian pyramid
+	reconstruct(gaussPyramid[maxLevel], laplacePyramid, res);
+}
+
+void localLaplacianFilter(cv::Mat& img, cv::Mat& res, int maxLevel, const RemapTable& remap) {
+	vector<cv::Mat> gaussPyramid;
+	gaussianPyramid(img, gaussPyramid, maxLevel);
+	localLaplacianFilter(img, gaussPyramid, res, maxLevel, remap);
+}
+
+// extend the per-channel intensity range by the values of "img"
+void updateRange(const cv::Mat& img, cv::Scalar& minvals, cv::Scalar& maxvals) {
+	const int dim = img.channels();
+	for(int y=0; y<img.rows; y++) {
+		const float* p = img.ptr<float>(y);
+		for(int x=0; x<img.cols; x++) {
+			for(int c=0; c<dim; c++) {
+				minvals[c] = min(minvals[c], (double)p[x*dim+c]);
+				maxvals[c] = max(maxvals[c], (double)p[x*dim+c]);
+			}
+		}
+	}
+}
+
+// fast local laplacian filter [Aubry et al. 2014].
+// the whole image is remapped at "nSamples" regularly sampled intensities,
+// and each coefficient is linearly interpolated between the laplacian pyramids
+// of the two samples around its gaussian coefficient. channels are remapped
+// independently, which approximates the color distance of the reference.
+// the samples span [minvals, maxvals] of each channel, and "gaussPyramids"
+// are the gaussian pyramids of "channels".
+void fastLocalLaplacianFilter(vector<cv::Mat>& channels, vector<vector<cv::Mat> >& gaussPyramids, cv::Mat& res, int maxLevel, const RemapTable& remap, int nSamples, const cv::Scalar& minvals, const cv::Scalar& maxvals) {
+	const int dim = (int)channels.size();
+
+	vector<cv::Mat> results(dim);
+	for(int c=0; c<dim; c++) {
+		vector<cv::Mat>& gaussPyramid = gaussPyramids[c];
+
+		vector<cv::Mat> laplacePyramid(maxLevel);
+		for(int level=0; level<maxLevel; level++) {
+			laplacePyramid[level] = cv::Mat::zeros(gaussPyramid[level].size(), CV_32FC1);
+		}
+
+		const double minval = minvals[c];
+		const double maxval = maxvals[c];
+		const double step = max(maxval - minval, 1.0e-6) / (nSamples - 1);
+
+		for(int i=0; i<nSamples; i++) {
+			const float gamma = (float)(minval + i * step);
+
+			cv::Mat R;
+			channels[c].convertTo(R, CV_32F);
+			remap.apply(R, gamma);
+
+			vector<cv::Mat> remapPyramid;
+			gaussianPyramid(R, remapPyramid, maxLevel);
+
+			for(int level=0; level<maxLevel; level++) {
+				cv::Mat up;
+				cv::pyrUp(remapPyramid[level+1], up, remapPyramid[level].size());
+
+				cv::Mat& G = gaussPyramid[level];
+				cv::Mat& L = laplacePyramid[level];
+				#ifdef _OPENMP
+				#pragma omp parallel for
+				#endif
+				for(int y=0; y<G.rows; y++) {
+					float* gp = G.ptr<float>(y);
+					float* rp = remapPyramid[level].ptr<float>(y);
+					float* up_p = up.ptr<float>(y);
+					float* lp = L.ptr<float>(y);
+					for(int x=0; x<G.cols; x++) {
+						float w = 1.0f - (float)(abs(gp[x] - gamma) / step);
+						if(w > 0.0f) {
+							lp[x] += w * (rp[x] - up_p[x]);
+						}
+					}
+				}
+			}
+		}
+		reconstruct(gaussPyramid[maxLevel], laplacePyramid, results[c]);
+	}
+	cv::merge(results, res);
+}
+
+void fastLocalLaplacianFilter(cv::Mat& img, cv::Mat& res, int maxLevel, const RemapTable& remap, int nSamples, const cv::Scalar& minvals, const cv::Scalar& maxvals) {
+	vector<cv::Mat> channels;
+	cv::split(img, channels);
+	vector<vector<cv::Mat> > gaussPyramids(channels.size());
+	for(int c=0; c<(int)channels.size(); c++) {
+		gaussianPyramid(channels[c], gaussPyramids[c], maxLevel);
+	}
+	fastLocalLaplacianFilter(channels, gaussPyramids, res, maxLevel, remap, nSamples, minvals, maxvals);
+}
+
+void fastLocalLaplacianFilter(cv::Mat& img, cv::Mat& res, int maxLevel, const RemapTable& remap, int nSamples) {
+	cv::Scalar minvals = cv::Scalar::all(DBL_MAX);
+	cv::Scalar maxvals = cv::Scalar::all(-DBL_MAX);
+	updateRange(img, minvals, maxvals);
+	fastLocalLaplacianFilter(img, res, maxLevel, remap, nSamples, minvals, maxvals);
+}
+
+// offset of the log-luminance to avoid log(0)
+const double lumEps = 1.0e-4;
+
+// largest distance of two log-luminance values of a [0, 1] image
+double logLuminanceRange() {
+	return log((1.0 + lumEps) / lumEps);
+}
+
+// luminance and its logarithm of a color image
+void logLuminance(cv::Mat& img, cv::Mat& lum, cv::Mat& logLum) {
+	cv::cvtColor(img, lum, CV_BGR2GRAY);
+	logLum.create(img.rows, img.cols, CV_32FC1);
+	for(int y=0; y<img.rows; y++) {
+		float* lp = lum.ptr<float>(y);
+		float* op = logLum.ptr<float>(y);
+		for(int x=0; x<img.cols; x++) {
+			op[x] = (float)log(lp[x] + lumEps);
+		}
+	}
+}
+
+// restore color from the filtered log-luminance: out = in * L' / L
+void restoreColor(cv::Mat& img, cv::Mat& lum, cv::Mat& filtered, cv::Mat& res) {
+	res.create(img.rows, img.cols, CV_32FC3);
+	#ifdef _OPENMP
+	#pragma omp parallel for
+	#endif
+	for(int y=0; y<img.rows; y++) {
+		const float* ip = img.ptr<float>(y);
+		const float* lp = lum.ptr<float>(y);
+		const float* fp = filtered.ptr<float>(y);
+		float* rp = res.ptr<float>(y);
+		for(int x=0; x<img.cols; x++) {
+			float ratio = (float)(exp(fp[x]) / (lp[x] + lumEps));
+			rp[3*x+0] = ip[3*x+0] * ratio;
+			rp[3*x+1] = ip[3*x+1] * ratio;
+			rp[3*x+2] = ip[3*x+2] * ratio;
+		}
+	}
+}
+
+// filter only the log-luminance and restore color by per-pixel ratio [Paris et al. 2011].
+// the pyramids are single channel, so this is about three times cheaper than
+// filtering the color image, and sigma_r is measured in log-luminance.
+void luminanceLocalLaplacianFilter(cv::Mat& img, cv::Mat& res, int maxLevel, const RemapTable& remap, const string& mode, int nSamples) {
+	cv::Mat lum, logLum, filtered;
+	logLuminance(img, lum, logLum);
+	if(mode == "exact") {
+		localLaplacianFilter(logLum, filtered, maxLevel, remap);
+	} else {
+		fastLocalLaplacianFilter(logLum, filtered, maxLevel, remap, nSamples);
+	}
+	restoreColor(img, lum, filtered, res);
+}
+
+// parameter sweep: filter one image with many remapping functions.
+// the input dependent part (log-luminance, channels, intensity ranges and
+// gaussian pyramids) is computed once and shared by all the settings.
+// the settings are evaluated one after another, each filter using all the
+// threads, so only one set of per-thread workspaces is alive at a time.
+void sweepLocalLaplacianFilter(cv::Mat& img, vector<cv::Mat>& results, int maxLevel, const vector<RemapTable>& remaps, const string& mode, int nSamples, const string& color) {
+	cv::Mat lum, input;
+	if(color == "lum") {
+		logLuminance(img, lum, input);
+	} else {
+		input = img;
+	}
+
+	vector<cv::Mat> gaussPyramid, channels;
+	vector<vector<cv::Mat> > gaussPyramids;
+	cv::Scalar minvals = cv::Scalar::all(DBL_MAX);
+	cv::Scalar maxvals = cv::Scalar::all(-DBL_MAX);
+	if(mode == "exact") {
+		gaussianPyramid(input, gaussPyramid, maxLevel);
+	} else {
+		cv::split(input, channels);
+		gaussPyramids.resize(channels.size());
+		for(int c=0; c<(int)channels.size(); c++) {
+			gaussianPyramid(channels[c], gaussPyramids[c], maxLevel);
+		}
+		updateRange(input, minvals, maxvals);
+	}
+
+	const int n = (int)remaps.size();
+	results.resize(n);
+	for(int i=0; i<n; i++) {
+		printf("  Setting %d / %d ...\n", i+1, n);
+		cv::Mat res;
+		if(mode == "exact") {
+			localLaplacianFilter(input, gaussPyramid, res, maxLevel, remaps[i]);
+		} else {
+			fastLocalLaplacianFilter(channels, gaussPyramids, res, maxLevel, remaps[i], nSamples, minvals, maxvals);
+		}
+
+		if(color == "lum") {
+			restoreColor(img, lum, res, results[i]);
+		} else {
+			results[i] = res;
+		}
+	}
+}
+
+// load parameter sets of a sweep.
+// each line is "sigma_r alpha tau [beta]" (beta defaults to 0.5).
+bool loadSettings(const string& filename, vector<RemapParams>& settings) {
+	FILE* fp = fopen(filename.c_str(), "r");
+	if(fp == NULL) {
+		return false;
+	}
+
+	char line[256];
+	settings.clear();
+	while(fgets(line, sizeof(line), fp) != NULL) {
+		RemapParams p = { 0.0, 0.0, 0.0, 0.5 };
+		if(sscanf(line, "%lf %lf %lf %lf", &p.sigma_r, &p.alpha, &p.tau, &p.beta) >= 3) {
+			settings.push_back(p);
+		}
+	}
+	fclose(fp);
+	return true;
+}
+
+// 64 bit file seek for images larger than 2GB
+int seekFile(FILE* fp, long long offset) {
+#ifdef _MSC_VER
+	return _fseeki64(fp, offset, SEEK_SET);
+#else
+	return fseeko(fp, (off_t)offset, SEEK_SET);
+#endif
+}
+
+// read the header of a binary PPM (P6) with 8 bit samples.
+// returns the offset of the pixel data, or -1 if the format is not supported.
+long long readPPMHeader(FILE* fp, int& width, int& height) {
+	char magic[3] = { 0 };
+	int  values[3];
+	if(fread(magic, 1, 2, fp) != 2 || string(magic) != "P6") return -1;
+	for(int i=0; i<3; i++) {
+		int ch = fgetc(fp);
+		while(isspace(ch) || ch == '#') {
+			if(ch == '#') {
+				while(ch != '\n' && ch != EOF) ch = fgetc(fp);
+			}
+			ch = fgetc(fp);
+		}
+		ungetc(ch, fp);
+		if(fscanf(fp, "%d", &values[i]) != 1) return -1;
+	}
+	fgetc(fp);
+	width  = values[0];
+	height = values[1];
+	if(values[2] != 255) return -1;
+	return (long long)ftell(fp);
+}
+
+// support of a pixel of the result in the input, in pixels of the finest level.
+// it covers the remapped window of the deepest level (K = 3 * (2^(l+2) - 1),
+// widened by up to 2^(l+1) - 1 to start on the grid), the gaussian pyramid
+// (pyrDown radius 2 per level), and the pyrUp of the reconstruction.
+int tileHalo(int maxLevel, const string& mode) {
+	const int scale = 1 << maxLevel;
+	int halo = 2 * (scale - 1) + 4 * scale;
+	if(mode == "exact") {
+		halo += 3 * (2 * scale - 1) + scale - 1;
+	}
+	return (halo + scale - 1) / scale * scale;
+}
+
+// tiled out-of-core local laplacian filter for images that do not fit in memory.
+// the input is streamed from a binary PPM and the result is written as a PFM
+// (32 bit float, the same values as the in-memory filter) tile by tile.
+// each tile is filtered with a halo covering the support of its center, and
+// tile origins are aligned to the coarsest level, so that the pyramids of a
+// tile sample the same positions as those of the whole image and the result is
+// bit-identical. the tile size is chosen to keep a tile within "budgetMB".
+bool tiledLocalLaplacianFilter(const string& input, const string& output, double budgetMB, int maxLevel, const RemapTable& remap, const string& mode, int nSamples, const string& color) {
+	// rough peak bytes per pixel of a tile (image, pyramids and temporaries)
+	const double bytesPerPixel = 96.0;
+
+	FILE* in = fopen(input.c_str(), "rb");
+	if(in == NULL) {
+		printf("Failed to open file \"%s\"\n", input.c_str());
+		return false;
+	}
+
+	int width, height;
+	const long long inOffset = readPPMHeader(in, width, height);
+	if(inOffset < 0) {
+		printf("\"%s\" is not a binary PPM with 8 bit samples\n", input.c_str());
+		fclose(in);
+		return false;
+	}
+
+	const int scale = 1 << maxLevel;
+	const int halo  = tileHalo(maxLevel, mode);
+	int tileSize = (int)sqrt(budgetMB * 1024.0 * 1024.0 / bytesPerPixel) - 2 * halo;
+	tileSize = tileSize / scale * scale;
+	if(tileSize < scale) {
+		printf("Memory budget is too small for the halo of %d pixels\n", halo);
+		fclose(in);
+		return false;
+	}
+	printf("  tiles     = %d x %d pixels (halo %d)\n", tileSize, tileSize, halo);
+
+	// the fast mode samples intensities over the range of the whole image
+	cv::Scalar minvals = cv::Scalar::all(DBL_MAX);
+	cv::Scalar maxvals = cv::Scalar::all(-DBL_MAX);
+	if(mode == "fast") {
+		cv::Mat row(1, width, CV_8UC3), rowf, lum, logLum;
+		seekFile(in, inOffset);
+		for(int y=0; y<height; y++) {
+			if(fread(row.ptr(0), 3, width, in) != (size_t)width) {
+				printf("Failed to read file \"%s\"\n", input.c_str());
+				fclose(in);
+				return false;
+			}
+			cv::cvtColor(row, row, CV_RGB2BGR);
+			row.convertTo(rowf, CV_32F, 1.0 / 255.0);
+			if(color == "lum") {
+				logLuminance(rowf, lum, logLum);
+				updateRange(logLum, minvals, maxvals);
+			} else {
+				updateRange(rowf, minvals, maxvals);
+			}
+		}
+	}
+
+	FILE* out = fopen(output.c_str(), "wb");
+	if(out == NULL) {
+		printf("Failed to open file \"%s\"\n", output.c_str());
+		fclose(in);
+		return false;
+	}
+	fprintf(out, "PF\n%d %d\n-1.0\n", width, height);
+	const long long outOffset = (long long)ftell(out);
+
+	const int tilesX = (width  + tileSize - 1) / tileSize;
+	const int tilesY = (height + tileSize - 1) / tileSize;
+	for(int ty=0; ty<tilesY; ty++) {
+		for(int tx=0; tx<tilesX; tx++) {
+			printf("  Tile %d / %d ...\n", ty * tilesX + tx + 1, tilesX * tilesY);
+
+			// tile with halo, clipped by the image
+			cv::Rect center(tx * tileSize, ty * tileSize, tileSize, tileSize);
+			center &= cv::Rect(0, 0, width, height);
+			const int x0 = max(0, center.x - halo);
+			const int y0 = max(0, center.y - halo);
+			const int x1 = min(width,  center.x + center.width  + halo);
+			const int y1 = min(height, center.y + center.height + halo);
+
+			cv::Mat tile(y1 - y0, x1 - x0, CV_8UC3);
+			for(int y=y0; y<y1; y++) {
+				seekFile(in, inOffset + ((long long)y * width + x0) * 3);
+				if(fread(tile.ptr(y - y0), 3, tile.cols, in) != (size_t)tile.cols) {
+					printf("Failed to read file \"%s\"\n", input.c_str());
+					fclose(in);
+					fclose(out);
+					return false;
+				}
+			}
+			cv::cvtColor(tile, tile, CV_RGB2BGR);
+
+			cv::Mat img, res;
+			tile.convertTo(img, CV_32F, 1.0 / 255.0);
+			if(color == "lum") {
+				cv::Mat lum, logLum, filtered;
+				logLuminance(img, lum, logLum);
+				if(mode == "exact") {
+					localLaplacianFilter(logLum, filtered, maxLevel, remap);
+				} else {
+					fastLocalLaplacianFilter(logLum, filtered, maxLevel, remap, nSamples, minvals, maxvals);
+				}
+				restoreColor(img, lum, filtered, res);
+			} else if(mode == "exact") {
+				localLaplacianFilter(img, res, maxLevel, remap);
+			} else {
+				fastLocalLaplacianFilter(img, res, maxLevel, remap, nSamples, minvals, maxvals);
+			}
+
+			// write the center (PFM is RGB and stored bottom to top)
+			cv::Mat rgb;
+			cv::cvtColor(res(center - cv::Point(x0, y0)), rgb, CV_BGR2RGB);
+			for(int y=0; y<center.height; y++) {
+				const long long row = height - 1 - (center.y + y);
+				seekFile(out, outOffset + (row * width + center.x) * 12);
+				fwrite(rgb.ptr(y), 12, center.width, out);
+			}
+		}
+	}
+
+	fclose(in);
+	fclose(out);
+	return true;
+}
+
+// main function
+// filter one image with all the parameter sets of "settingsFile"
+int sweepMain(int argc, char** argv) {
+	cv::Mat img = cv::imread(argv[2], CV_LOAD_IMAGE_COLOR);
+	if(img.empty()) {
+		cout << "Failed to load file \"" << argv[2] << "\"" << endl;
+		return -1;
+	}
+	img.convertTo(img, CV_32F, 1.0 / 255.0);
+
+	vector<RemapParams> settings;
+	if(!loadSettings(argv[3], settings)) {
+		cout << "Failed to load file \"" << argv[3] << "\"" << endl;
+		return -1;
+	}
+
+	const int    maxLevel = argc > 4 ? atoi(argv[4]) : 3;
+	const string mode     = argc > 5 ? argv[5] : "exact";
+	const int    nSamples = argc > 6 ? max(atoi(argv[6]), 2) : 10;
+	const string curve    = argc > 7 ? argv[7] : "detail";
+	const string color    = argc > 8 ? argv[8] : "rgb";
+
+	RemapCurve func = findCurve(curve);
+	if(func == NULL || (mode != "exact" && mode != "fast") || (color != "rgb" && color != "lum")) {
+		printf("Unknown curve, mode or color\n");
+		return -1;
+	}
+
+	printf("*** Local Laplacian Filter (sweep) ***\n");
+	printf("  settings  = %d\n", (int)settings.size());
+	printf("  max level = %d\n", maxLevel);
+	printf("  mode      = %s\n", mode.c_str());
+	printf("  curve     = %s\n", curve.c_str());
+	printf("  color     = %s\n", color.c_str());
+	printf("\n");
+
+	vector<RemapTable> remaps;
+	for(int i=0; i<(int)settings.size(); i++) {
+		remaps.push_back(RemapTable(func, settings[i], color == "lum" ? logLuminanceRange() : sqrt(3.0)));
+	}
+
+	double t = wallTime();
+	vector<cv::Mat> results;
+	sweepLocalLaplacianFilter(img, results, maxLevel, remaps, mode, nSamples, color);
+	printf("  Finish! (%.2f sec)\n\n", wallTime() - t);
+
+	for(int i=0; i<(int)results.size(); i++) {
+		char filename[256];
+		sprintf(filename, "sweep_%03d.png", i);
+		results[i].convertTo(results[i], CV_8U, 255.0);
+		cv::imwrite(filename, results[i]);
+		printf("  %s: sigma_r = %f, alpha = %f, tau = %f, beta = %f\n", filename,
+			settings[i].sigma_r, settings[i].alpha, settings[i].tau, settings[i].beta);
+	}
+	return 0;
+}
+
+// largest absolute difference of two float images of the same size
+double maxAbsDiff(const cv::Mat& a, const cv::Mat& b) {
+	double maxdiff = 0.0;
+	for(int y=0; y<a.rows; y++) {
+		const float* p = a.ptr<float>(y);
+		const float* q = b.ptr<float>(y);
+		for(int x=0; x<a.cols*a.channels(); x++) {
+			maxdiff = max(maxdiff, (double)abs(p[x] - q[x]));
+		}
+	}
+	return maxdiff;
+}
+
+// compare the tabulated remapping with the direct evaluation of the curve,
+// including alpha < 1 where the curve is steepest at d = 0, and the fast
+// filter with the exact one on a step edge with texture
+int checkMain() {
+	const double alphas[3] = { 0.25, 0.5, 4.0 };
+	const double maxDist = sqrt(3.0);
+	const int    n = 100000;
+	int failed = 0;
+	for(int i=0; i<3; i++) {
+		RemapParams params = { 0.2, alphas[i], 1.0, 0.5 };
+		RemapTable remap(detailCurve, params, maxDist);
+
+		// dense near 0 (below one table step), then uniform up to maxDist
+		cv::Mat R = cv::Mat(1, 2*n, CV_32FC1);
+		for(int k=0; k<n; k++) {
+			R.at<float>(0, k)   = (float)(1.0e-4 * k / n);
+			R.at<float>(0, n+k) = (float)(maxDist * k / (n-1));
+		}
+		cv::Mat S = R.clone();
+		remap.apply(S, 0.0f);
+
+		double maxerr = 0.0;
+		for(int k=0; k<2*n; k++) {
+			maxerr = max(maxerr, abs(S.at<float>(0, k) - detailCurve(R.at<float>(0, k), params)));
+		}
+		bool ok = maxerr < 1.0e-3;
+		printf("[%s] remap table, alpha = %.2f: max error %.2e\n", ok ? "PASS" : "FAIL", alphas[i], maxerr);
+		if(!ok) failed++;
+	}
+
+	const int width = 96, height = 64, maxLevel = 3;
+	cv::Mat img = cv::Mat(height, width, CV_32FC1);
+	for(int y=0; y<height; y++) {
+		for(int x=0; x<width; x++) {
+			img.at<float>(y, x) = (x < width/2 ? 0.2f : 0.8f) + 0.05f * (float)sin(0.7 * x + 0.3 * y);
+		}
+	}
+
+	// the identity curve must give back the input with both filters
+	{
+		RemapParams params = { 0.2, 1.0, 1.0, 0.5 };
+		RemapTable remap(detailCurve, params, 1.0);
+		cv::Mat exact, fast;
+		localLaplacianFilter(img, exact, maxLevel, remap);
+		fastLocalLaplacianFilter(img, fast, maxLevel, remap, 10, cv::Scalar(0.0), cv::Scalar(1.0));
+		double errExact = maxAbsDiff(exact, img);
+		double errFast  = maxAbsDiff(fast, img);
+		bool ok = errExact < 1.0e-4 && errFast < 1.0e-4;
+		printf("[%s] identity curve: exact %.2e, fast %.2e from the input\n", ok ? "PASS" : "FAIL", errExact, errFast);
+		if(!ok) failed++;
+	}
+
+	// one channel: fast approaches exact as the samples increase
+	{
+		RemapParams params = { 0.2, 4.0, 1.0, 0.5 };
+		RemapTable remap(detailCurve, params, 1.0);
+		cv::Mat exact;
+		localLaplacianFilter(img, exact, maxLevel, remap);
+		const int samples[3] = { 10, 20, 40 };
+		for(int i=0; i<3; i++) {
+			cv::Mat fast;
+			fastLocalLaplacianFilter(img, fast, maxLevel, remap, samples[i], cv::Scalar(0.0), cv::Scalar(1.0));
+			double err = maxAbsDiff(fast, exact);
+			bool ok = err * 255.0 < 40.0 / samples[i];	// shrinks with the sample step
+			printf("[%s] fast vs exact, alpha = 4, %d samples: max diff %.2f / 255\n", ok ? "PASS" : "FAIL", samples[i], err * 255.0);
+			if(!ok) failed++;
+		}
+	}
+	return failed == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+	// "check" tests the remapping table against the curves
+	if(argc > 1 && string(argv[1]) == "check") {
+		return checkMain();
+	}
+
+	// "sweep" filters an image with many parameter sets
+	if(argc > 1 && string(argv[1]) == "sweep") {
+		if(argc <= 3) {
+			cout << "usage: LocalLaplacianFilter.exe sweep [input image] [settings file] ([max level] [mode] [samples] [curve] [color])" << endl;
+			return -1;
+		}
+		return sweepMain(argc, argv);
+	}
+
+	// "tiled" streams a PPM from disk instead of loading the whole image
+	const bool tiled = argc > 1 && string(argv[1]) == "tiled";
+	const int  a     = tiled ? 4 : 1;
+	if(argc <= a) {
+		cout << "usage: LocalLaplacianFilter.exe [input image] ([sigma_r] [max level] [alpha] [tau] [mode] [samples] [curve] [beta] [color])" << endl;
+		cout << "       LocalLaplacianFilter.exe tiled [input ppm] [output pfm] [memory MB] ([sigma_r] ...)" << endl;
+		cout << "       LocalLaplacianFilter.exe sweep [input image] [settings file] ([max level] [mode] [samples] [curve] [color])" << endl;
+		cout << "       LocalLaplacianFilter.exe check" << endl;
+		cout << "  mode: exact (default), fast" << endl;
+		cout << "  curve: detail (default), tone" << endl;
+		cout << "  color: rgb (default), lum" << endl;
+		return -1;
+	}
+
+	cv::Mat img;
+	if(!tiled) {
+		img = cv::imread(argv[1], CV_LOAD_IMAGE_COLOR);
+		if(img.empty()) {
+			cout << "Failed to load file \"" << argv[1] << "\"" << endl;
+			return -1;
+		}
+		img.convertTo(img, CV_32F, 1.0 / 255.0);
+	}
+
+	// initial parameter values
+	const double sigma_r  = argc > a+1 ? atof(argv[a+1]) : 0.2;
+	const int    maxLevel = argc > a+2 ? atoi(argv[a+2]) : 3;
+	const double alpha    = argc > a+3 ? atof(argv[a+3]) : 4.0;
+	const double tau      = argc > a+4 ? atof(argv[a+4]) : 0.8;
+	const string mode     = argc > a+5 ? argv[a+5] : "exact";
+	const int    nSamples = argc > a+6 ? max(atoi(argv[a+6]), 2) : 10;
+	const string curve    = argc > a+7 ? argv[a+7] : "detail";
+	const double beta     = argc > a+8 ? atof(argv[a+8]) : 0.5;
+	const string color    = argc > a+9 ? argv[a+9] : "rgb";
+
+	// stdout info.
+	printf("*** Local Laplacian Filter ***\n");
+	printf("  sigma_r   = %f\n", sigma_r);
+	printf("  max level = %d\n", maxLevel);
+	printf("  alpha     = %f\n", alpha);
+	printf("  tau       = %f\n", tau);
+	printf("  mode      = %s\n", mode.c_str());
+	if(mode == "fast") {
+		printf("  samples   = %d\n", nSamples);
+	}
+	printf("  curve     = %s\n", curve.c_str());
+	if(curve == "tone") {
+		printf("  beta      = %f\n", beta);
+	}
+	printf("  color     = %s\n", color.c_str());
+	printf("\n");	
+	
+	// tabulate remapping function
+	// (color distance of [0, 1] images is at most sqrt(3))
+	RemapParams params = { sigma_r, alpha, tau, beta };
+	RemapCurve func = findCurve(curve);
+	if(func == NULL) {
+		printf("Unknown curve \"%s\"\n", curve.c_str());
+		return -1;
+	}
+	if(mode != "exact" && mode != "fast") {
+		printf("Unknown mode \"%s\"\n", mode.c_str());
+		return -1;
+	}
+	if(color != "rgb" && color != "lum") {
+		printf("Unknown color \"%s\"\n", color.c_str());
+		return -1;
+	}
+	RemapTable remap(func, params, color == "lum" ? logLuminanceRange() : sqrt(3.0));
+
+	double t = wallTime();
+	if(tiled) {
+		if(!tiledLocalLaplacianFilter(argv[2], argv[3], atof(argv[4]), maxLevel, remap, mode, nSamples, color)) {
+			return -1;
+		}
+		printf("  Finish! (%.2f sec)\n\n", wallTime() - t);
+		return 0;
+	}
+
 	cv::Mat res;
-	gaussPyramid[maxLevel].convertTo(res, CV_32F);
-	for(int level=maxLevel-1; level>=0; level--) {
-		cv::pyrUp(res, tmp, gaussPyramid[level].size());		
-		res = tmp + laplacePyramid[level];
+	if(color == "lum") {
+		luminanceLocalLaplacianFilter(img, res, maxLevel, remap, mode, nSamples);
+	} else if(mode == "exact") {
+		localLaplacianFilter(img, res, maxLevel, remap);
+	} else {
+		fastLocalLaplacianFilter(img, res, maxLevel, remap, nSamples);
 	}
+	printf("  Finish! (%.2f sec)\n\n", wallTime() - t);
 
 	// show results
 	cv::imshow("Input", img);
@@ -1,31 +1,354 @@
 #include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
 #include <time.h>
+#include <stdio.h>
 #include <stdlib.h>
 using namespace std;
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "opencv2/opencv.hpp"
 
-const float eps = 0.05f;
-const int r = 4;
+const int r = 4;	// radius around unchanged pixels where the base gradient is kept
+const float qtTol = 1.0e-3f;
+const float mgTol = 1.0e-4f;
+const int mgMaxCycles = 50;
+const float sorTol = 1.0e-4f;
+const int sorMaxIter = 5000;
+const float cgTol = 1.0e-4f;
+const int cgMaxIter = 2000;
 const int offset[4][2] = {
 	{-1, 0}, {1, 0}, {0, -1}, {0, 1}
 };
 
-void solvePoisson(cv::Mat& base, cv::Mat& laplace, cv::Mat& res, int tlx, int tly, int brx, int bry, cv::Mat& region, int depth=0, int maxDepth=5) {
+double wallTime() {
+#ifdef _OPENMP
+	return omp_get_wtime();
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// one node of the adaptive quadtree. "tile" is a private copy of res covering
+// the node plus one pixel of halo (clipped to the image) with its top-left at (ox, oy).
+// the node is relaxed by Gauss-Seidel, and split into four quadrants solved as
+// parallel tasks when its RMS residual is still larger than "tol". each quadrant
+// gets its own copy (with halo) of the parent tile, so siblings never touch shared pixels.
+void quadtreeNode(cv::Mat& laplace, cv::Mat& tile, int ox, int oy, int tlx, int tly, int brx, int bry, cv::Mat& region, int depth, int maxDepth, float tol, vector<double>& depthTime, vector<int>& depthTiles) {
+	int width = laplace.cols;
+	int height = laplace.rows;
+	int dim = laplace.channels();
+
+	double t0 = wallTime();
+	for(int it=0; it<20; it++) {
+		for(int y=tly; y<bry; y++) {
+			for(int x=tlx; x<brx; x++) {
+				for(int c=0; c<dim; c++) {
+					float sum = 0.0;
+					float w = 0.0;
+					for(int k=0; k<4; k++) {
+						int xx = x + offset[k][0];
+						int yy = y + offset[k][1];
+						if(xx >= 0 && yy >= 0 && xx < width && yy < height) {
+							sum += tile.at<float>(yy-oy, (xx-ox)*dim+c);
+							w += 1.0;
+						}
+					}
+					tile.at<float>(y-oy, (x-ox)*dim+c) = (sum - laplace.at<float>(y, x*dim+c)) / w;
+				}
+			}
+		}
+	}
+
+	// RMS residual of the tile
+	double sqsum = 0.0;
+	for(int y=tly; y<bry; y++) {
+		for(int x=tlx; x<brx; x++) {
+			for(int c=0; c<dim; c++) {
+				float sum = 0.0;
+				float w = 0.0;
+				for(int k=0; k<4; k++) {
+					int xx = x + offset[k][0];
+					int yy = y + offset[k][1];
+					if(xx >= 0 && yy >= 0 && xx < width && yy < height) {
+						sum += tile.at<float>(yy-oy, (xx-ox)*dim+c);
+						w += 1.0;
+					}
+				}
+				float rv = laplace.at<float>(y, x*dim+c) - (sum - w * tile.at<float>(y-oy, (x-ox)*dim+c));
+				sqsum += rv * rv;
+			}
+		}
+	}
+	float rms = (float)sqrt(sqsum / ((brx - tlx) * (bry - tly) * dim));
+
+	double dt = wallTime() - t0;
+	#ifdef _OPENMP
+	#pragma omp atomic
+	#endif
+	depthTime[depth] += dt;
+	#ifdef _OPENMP
+	#pragma omp atomic
+	#endif
+	depthTiles[depth]++;
+
+	if(depth < maxDepth && rms > tol && brx - tlx >= 2 && bry - tly >= 2) {
+		int midx = (tlx + brx) / 2;
+		int midy = (tly + bry) / 2;
+		int rects[4][4] = {
+			{tlx, tly, midx, midy}, {midx, tly, brx, midy},
+			{tlx, midy, midx, bry}, {midx, midy, brx, bry}
+		};
+
+		// halo exchange: every quadrant copies its neighbours' edges from this tile
+		cv::Mat tiles[4];
+		int tox[4], toy[4];
+		for(int q=0; q<4; q++) {
+			tox[q] = max(rects[q][0]-1, 0);
+			toy[q] = max(rects[q][1]-1, 0);
+			int hx = min(rects[q][2]+1, width);
+			int hy = min(rects[q][3]+1, height);
+			tiles[q] = tile(cv::Rect(tox[q]-ox, toy[q]-oy, hx-tox[q], hy-toy[q])).clone();
+		}
+
+		for(int q=0; q<4; q++) {
+			#if defined(_OPENMP) && _OPENMP >= 200805
+			#pragma omp task default(shared) firstprivate(q)
+			#endif
+			quadtreeNode(laplace, tiles[q], tox[q], toy[q], rects[q][0], rects[q][1], rects[q][2], rects[q][3], region, depth+1, maxDepth, tol, depthTime, depthTiles);
+		}
+		#if defined(_OPENMP) && _OPENMP >= 200805
+		#pragma omp taskwait
+		#endif
+
+		for(int q=0; q<4; q++) {
+			cv::Rect inner(rects[q][0], rects[q][1], rects[q][2]-rects[q][0], rects[q][3]-rects[q][1]);
+			tiles[q](cv::Rect(inner.x-tox[q], inner.y-toy[q], inner.width, inner.height)).copyTo(tile(cv::Rect(inner.x-ox, inner.y-oy, inner.width, inner.height)));
+		}
+		return;
+	}
+
+	// paint computed region
+	uchar color = (uchar)(((unsigned int)tlx * 73856093u ^ (unsigned int)tly * 19349663u) % 255);
+	for(int y=tly; y<bry; y++) {
+		for(int x=tlx; x<brx; x++) {
+			region.at<uchar>(y, x) = color;
+		}
+	}
+}
+
+// solve poisson equation with adaptive quadtree Gauss-Seidel.
+// tiles whose residual does not fall below "tol" are refined up to "maxDepth",
+// and the number of tiles and relaxation time of each depth are reported.
+void solvePoisson(cv::Mat& base, cv::Mat& laplace, cv::Mat& res, int tlx, int tly, int brx, int bry, cv::Mat& region, int maxDepth=5, float tol=qtTol) {
+	int width = base.cols;
+	int height = base.rows;
+	int dim = base.channels();
+
+	if(res.empty()) {
+		base.convertTo(res, CV_MAKETYPE(CV_32F, dim));
+	}
+
+	vector<double> depthTime(maxDepth+1, 0.0);
+	vector<int> depthTiles(maxDepth+1, 0);
+
+	int ox = max(tlx-1, 0);
+	int oy = max(tly-1, 0);
+	cv::Rect outer(ox, oy, min(brx+1, width) - ox, min(bry+1, height) - oy);
+	cv::Mat tile = res(outer).clone();
+
+	#if defined(_OPENMP) && _OPENMP >= 200805
+	#pragma omp parallel
+	#pragma omp single
+	#endif
+	quadtreeNode(laplace, tile, ox, oy, tlx, tly, brx, bry, region, 0, maxDepth, tol, depthTime, depthTiles);
+
+	tile(cv::Rect(tlx-ox, tly-oy, brx-tlx, bry-tly)).copyTo(res(cv::Rect(tlx, tly, brx-tlx, bry-tly)));
+
+	for(int d=0; d<=maxDepth; d++) {
+		if(depthTiles[d] == 0) break;
+		printf("  depth %d: %5d tiles, %.3f sec\n", d, depthTiles[d], depthTime[d]);
+	}
+}
+
+// one level of the multigrid hierarchy.
+// both grids have one pixel of zero border (Dirichlet condition for the correction)
+// and coarse pixel (x, y) lies on fine pixel (2x, 2y) in padded coordinates.
+// a fine grid of n pixels has n/2 coarse pixels, so the right / bottom boundary of
+// the coarse grid does not always fall on a coarse pixel. its true distance from the
+// last column / row (in pixels of the level, 0 < d <= 1) is kept, and the stencil
+// there uses the weight 1 + 1/d, which is what the Galerkin coarse operator gives.
+struct MGLevel {
+	cv::Mat u;	// correction
+	cv::Mat f;	// right hand side
+	float dx, dy;	// distance from the last column / row to the right / bottom boundary
+};
+
+// red-black Gauss-Seidel smoothing of "sum(u_nb) - 4u = f" (with the weights of the boundary distance)
+void mgSmooth(MGLevel& level, int iters) {
+	cv::Mat& u = level.u;
+	cv::Mat& f = level.f;
+	int width  = u.cols - 2;
+	int height = u.rows - 2;
+	int dim    = u.channels();
+
+	for(int it=0; it<iters; it++) {
+		for(int color=0; color<2; color++) {
+			for(int y=1; y<=height; y++) {
+				float* up = u.ptr<float>(y-1);
+				float* uc = u.ptr<float>(y);
+				float* un = u.ptr<float>(y+1);
+				float* fc = f.ptr<float>(y);
+				float wy = y == height ? 1.0f + 1.0f / level.dy : 2.0f;
+				for(int x=1+((y+color+1)&1); x<=width; x+=2) {
+					float w = wy + (x == width ? 1.0f + 1.0f / level.dx : 2.0f);
+					for(int c=0; c<dim; c++) {
+						int i = x*dim+c;
+						uc[i] = (uc[i-dim] + uc[i+dim] + up[i] + un[i] - fc[i]) / w;
+					}
+				}
+			}
+		}
+	}
+}
+
+// residual "f - (sum(u_nb) - 4u)" on a padded grid
+void mgResidual(MGLevel& level, cv::Mat& r) {
+	cv::Mat& u = level.u;
+	cv::Mat& f = level.f;
+	int width  = u.cols - 2;
+	int height = u.rows - 2;
+	int dim    = u.channels();
+
+	r = cv::Mat::zeros(u.size(), u.type());
+	for(int y=1; y<=height; y++) {
+		float* up = u.ptr<float>(y-1);
+		float* uc = u.ptr<float>(y);
+		float* un = u.ptr<float>(y+1);
+		float* fc = f.ptr<float>(y);
+		float* rc = r.ptr<float>(y);
+		float wy = y == height ? 1.0f + 1.0f / level.dy : 2.0f;
+		for(int x=1; x<=width; x++) {
+			float w = wy + (x == width ? 1.0f + 1.0f / level.dx : 2.0f);
+			for(int c=0; c<dim; c++) {
+				int i = x*dim+c;
+				rc[i] = fc[i] - (uc[i-dim] + uc[i+dim] + up[i] + un[i] - w * uc[i]);
+			}
+		}
+	}
+}
+
+// full weighting restriction. The coarse operator has twice the grid spacing,
+// so the right hand side is scaled by 4 to keep the same unscaled stencil.
+void mgRestrict(cv::Mat& r, cv::Mat& f) {
+	int width  = f.cols - 2;
+	int height = f.rows - 2;
+	int dim    = f.channels();
+
+	for(int y=1; y<=height; y++) {
+		int fy = 2*y;
+		float* rp = r.ptr<float>(fy-1);
+		float* rc = r.ptr<float>(fy);
+		float* rn = r.ptr<float>(fy+1);
+		float* fc = f.ptr<float>(y);
+		for(int x=1; x<=width; x++) {
+			int fx = 2*x;
+			for(int c=0; c<dim; c++) {
+				int i = fx*dim+c;
+				float center = rc[i];
+				float edge   = rc[i-dim] + rc[i+dim] + rp[i] + rn[i];
+				float corner = rp[i-dim] + rp[i+dim] + rn[i-dim] + rn[i+dim];
+				fc[x*dim+c] = 0.25f * (4.0f * center + 2.0f * edge + corner);
+			}
+		}
+	}
+}
+
+// bilinear prolongation of the coarse correction, added to the fine grid
+void mgProlongate(cv::Mat& e, cv::Mat& u) {
+	int width  = u.cols - 2;
+	int height = u.rows - 2;
+	int dim    = u.channels();
+
+	for(int y=1; y<=height; y++) {
+		int cy0 = y/2;
+		int cy1 = cy0 + (y&1);
+		float* e0 = e.ptr<float>(cy0);
+		float* e1 = e.ptr<float>(cy1);
+		float* uc = u.ptr<float>(y);
+		for(int x=1; x<=width; x++) {
+			int cx0 = x/2;
+			int cx1 = cx0 + (x&1);
+			for(int c=0; c<dim; c++) {
+				uc[x*dim+c] += 0.25f * (e0[cx0*dim+c] + e0[cx1*dim+c] + e1[cx0*dim+c] + e1[cx1*dim+c]);
+			}
+		}
+	}
+}
+
+void mgVCycle(vector<MGLevel>& levels, int l) {
+	MGLevel& fine = levels[l];
+	if(l == (int)levels.size() - 1) {
+		mgSmooth(fine, 50);
+		return;
+	}
+
+	mgSmooth(fine, 2);
+
+	cv::Mat r;
+	mgResidual(fine, r);
+	MGLevel& coarse = levels[l+1];
+	mgRestrict(r, coarse.f);
+	coarse.u.setTo(cv::Scalar::all(0.0));
+	mgVCycle(levels, l+1);
+	mgProlongate(coarse.u, fine.u);
+
+	mgSmooth(fine, 2);
+}
+
+// solve poisson equation with multigrid V-cycles.
+// pixels outside the rectangle are used as the Dirichlet boundary.
+int solvePoissonMultigrid(cv::Mat& base, cv::Mat& laplace, cv::Mat& res, int tlx, int tly, int brx, int bry, cv::Mat& region, float tol=mgTol, int maxCycles=mgMaxCycles) {
 	int width = base.cols;
 	int height = base.rows;
 	int dim = base.channels();
 
-	if(depth == 0) {
-		base.convertTo(res, CV_32FC3);
+	if(res.empty()) {
+		base.convertTo(res, CV_MAKETYPE(CV_32F, dim));
 	}
 
+	// build grid hierarchy
+	vector<MGLevel> levels;
 	int subw = brx - tlx;
 	int subh = bry - tly;
-	for(int it=0; it<20; it++) {
-		for(int c=0; c<dim; c++) {
-			for(int y=tly; y<bry; y++) {
-				for(int x=tlx; x<brx; x++) {
+	float dx = 1.0f, dy = 1.0f;
+	while(true) {
+		MGLevel level;
+		level.u = cv::Mat::zeros(subh+2, subw+2, CV_MAKETYPE(CV_32F, dim));
+		level.f = cv::Mat::zeros(subh+2, subw+2, CV_MAKETYPE(CV_32F, dim));
+		level.dx = dx;
+		level.dy = dy;
+		levels.push_back(level);
+		if(subw <= 2 || subh <= 2) break;
+		dx = 0.5f * (dx + (subw & 1));
+		dy = 0.5f * (dy + (subh & 1));
+		subw = subw / 2;
+		subh = subh / 2;
+	}
+
+	int cycle;
+	for(cycle=0; cycle<maxCycles; cycle++) {
+		// residual of the original problem becomes the right hand side of the correction
+		float maxres = 0.0f;
+		MGLevel& top = levels[0];
+		for(int y=tly; y<bry; y++) {
+			float* fc = top.f.ptr<float>(y-tly+1);
+			for(int x=tlx; x<brx; x++) {
+				for(int c=0; c<dim; c++) {
 					float sum = 0.0;
 					float w = 0.0;
 					for(int k=0; k<4; k++) {
@@ -36,33 +359,413 @@ void solvePoisson(cv::Mat& base, cv::Mat& laplace, cv::Mat& res, int tlx, int tl
 							w += 1.0;
 						}
 					}
-					res.at<float>(y, x*dim+c) = (sum - laplace.at<float>(y, x*dim+c)) / w;
+					float rv = laplace.at<float>(y, x*dim+c) - (sum - w * res.at<float>(y, x*dim+c));
+					fc[(x-tlx+1)*dim+c] = rv;
+					maxres = max(maxres, abs(rv));
+				}
+			}
+		}
+
+		cout << "  cycle " << cycle << ": residual = " << maxres << endl;
+		if(maxres <= tol) break;
+
+		top.u.setTo(cv::Scalar::all(0.0));
+		mgVCycle(levels, 0);
+		for(int y=tly; y<bry; y++) {
+			float* uc = top.u.ptr<float>(y-tly+1);
+			for(int x=tlx; x<brx; x++) {
+				for(int c=0; c<dim; c++) {
+					res.at<float>(y, x*dim+c) += uc[(x-tlx+1)*dim+c];
 				}
 			}
 		}
 	}
 
-	// compute difference
-	if(depth != maxDepth) {
+	// paint computed region
+	uchar color = rand() % 255;
+	for(int y=tly; y<bry; y++) {
+		for(int x=tlx; x<brx; x++) {
+			region.at<uchar>(y, x) = color;
+		}
+	}
+	return cycle;
+}
+
+// one red-black SOR half sweep over the pixels with (x + y) % 2 == color.
+// the pixels of the current color are updated in place. they only read pixels
+// of the other color, so the rows can be relaxed in parallel without races.
+// returns the max residual of the updated pixels.
+float sorHalfSweep(cv::Mat& laplace, cv::Mat& res, int tlx, int tly, int brx, int bry, float omega, int color, vector<float>& rowres) {
+	int dim = res.channels();
+
+	#ifdef _OPENMP
+	#pragma omp parallel for
+	#endif
+	for(int y=tly; y<bry; y++) {
+		const float* up = res.ptr<float>(y-1);
+		const float* un = res.ptr<float>(y+1);
+		const float* lc = laplace.ptr<float>(y);
+		float* uc = res.ptr<float>(y);
+
+		float maxdiff = 0.0f;
+		#if defined(_OPENMP) && _OPENMP >= 201307
+		#pragma omp simd reduction(max:maxdiff)
+		#endif
+		for(int x=tlx+((y+tlx+color)&1); x<brx; x+=2) {
+			for(int c=0; c<dim; c++) {
+				int i = x*dim+c;
+				float diff = omega * (0.25f * (uc[i-dim] + uc[i+dim] + up[i] + un[i] - lc[i]) - uc[i]);
+				maxdiff = max(maxdiff, abs(diff));
+				uc[i] += diff;
+			}
+		}
+		rowres[y] = 4.0f * maxdiff / omega;
+	}
+
+	float maxres = 0.0f;
+	for(int y=tly; y<bry; y++) {
+		maxres = max(maxres, rowres[y]);
+	}
+	return maxres;
+}
+
+// solve poisson equation with red-black successive over-relaxation.
+// the image border is kept fixed, so the rectangle is clipped to the interior.
+// omega <= 0 selects the optimal relaxation factor for the rectangle.
+int solvePoissonSOR(cv::Mat& base, cv::Mat& laplace, cv::Mat& res, int tlx, int tly, int brx, int bry, cv::Mat& region, float omega=0.0f, float tol=sorTol, int maxIter=sorMaxIter) {
+	int width = base.cols;
+	int height = base.rows;
+	int dim = base.channels();
+
+	if(res.empty()) {
+		base.convertTo(res, CV_MAKETYPE(CV_32F, dim));
+	}
+
+	tlx = max(tlx, 1);
+	tly = max(tly, 1);
+	brx = min(brx, width-1);
+	bry = min(bry, height-1);
+	if(tlx >= brx || tly >= bry) return 0;
+
+	if(omega <= 0.0f) {
+		omega = (float)(2.0 / (1.0 + sin(CV_PI / (max(brx - tlx, bry - tly) + 1))));
+	}
+
+	vector<float> rowres(height, 0.0f);
+
+	int it;
+	for(it=0; it<maxIter; it++) {
+		float maxres = 0.0f;
+		maxres = max(maxres, sorHalfSweep(laplace, res, tlx, tly, brx, bry, omega, 0, rowres));
+		maxres = max(maxres, sorHalfSweep(laplace, res, tlx, tly, brx, bry, omega, 1, rowres));
+		if(maxres <= tol) break;
+	}
+	cout << "  SOR: " << it << " sweeps (omega = " << omega << ")" << endl;
+
+	// paint computed region
+	uchar color = rand() % 255;
+	for(int y=tly; y<bry; y++) {
+		for(int x=tlx; x<brx; x++) {
+			region.at<uchar>(y, x) = color;
+		}
+	}
+	return it;
+}
+
+// bounding box [tlx, brx) x [tly, bry) of the nonzero mask pixels
+// (empty, with brx <= tlx, when the mask has no nonzero pixel)
+void maskBoundingBox(cv::Mat& mask, int& tlx, int& tly, int& brx, int& bry) {
+	tlx = mask.cols;
+	tly = mask.rows;
+	brx = 0;
+	bry = 0;
+	for(int y=0; y<mask.rows; y++) {
+		uchar* mp = mask.ptr<uchar>(y);
+		for(int x=0; x<mask.cols; x++) {
+			if(mp[x] != 0) {
+				tlx = min(tlx, x);
+				tly = min(tly, y);
+				brx = max(brx, x+1);
+				bry = max(bry, y+1);
+			}
+		}
+	}
+}
+
+// matrix-free product "out = A * v" with A = 4I - (adjacency of unknowns)
+void cgApply(vector<float>& v, vector<float>& out, vector<int>& nbr, int dim) {
+	const int n = (int)nbr.size() / 4;
+
+	#ifdef _OPENMP
+	#pragma omp parallel for
+	#endif
+	for(int i=0; i<n; i++) {
 		for(int c=0; c<dim; c++) {
-			for(int y=tly; y<bry; y++) {
-				for(int x=tlx; x<brx; x++) {
-					float r_val = res.at<float>(y, x*dim+c);
-					float b_val = base.at<float>(y, x*dim+c);
-					if(abs(r_val - b_val) > eps) {
-						int midx = (tlx + brx) / 2;
-						int midy = (tly + bry) / 2;
-						solvePoisson(base, laplace, res, tlx, tly, midx, midy, region, depth+1, maxDepth);
-						solvePoisson(base, laplace, res, tlx, midy, midx, bry, region, depth+1, maxDepth);
-						solvePoisson(base, laplace, res, midx, tly, brx, midy, region, depth+1, maxDepth);
-						solvePoisson(base, laplace, res, midx, midy, brx, bry, region, depth+1, maxDepth);
-						return;
-					}
+			float sum = 4.0f * v[i*dim+c];
+			for(int k=0; k<4; k++) {
+				int j = nbr[i*4+k];
+				if(j >= 0) sum -= v[j*dim+c];
+			}
+			out[i*dim+c] = sum;
+		}
+	}
+}
+
+// solve poisson equation only for the pixels inside "mask" with
+// conjugate gradient preconditioned by incomplete Cholesky, IC(0).
+// pixels outside the mask are the Dirichlet boundary. masked pixels on the image
+// border have no outer neighbour, so they are not solved either and keep their
+// value in "res". unknowns are indexed inside the bounding box of the mask, so
+// the cost is proportional to the number of masked pixels.
+int solvePoissonMaskedCG(cv::Mat& base, cv::Mat& laplace, cv::Mat& mask, cv::Mat& res, cv::Mat& region, float tol=cgTol, int maxIter=cgMaxIter) {
+	int width = base.cols;
+	int height = base.rows;
+	int dim = base.channels();
+
+	if(res.empty()) {
+		base.convertTo(res, CV_MAKETYPE(CV_32F, dim));
+	}
+
+	// compact list of unknowns in raster order, indexed inside the bounding box
+	// of the mask clipped to the image interior
+	int tlx, tly, brx, bry;
+	maskBoundingBox(mask, tlx, tly, brx, bry);
+	tlx = max(tlx, 1);
+	tly = max(tly, 1);
+	brx = min(brx, width-1);
+	bry = min(bry, height-1);
+	if(tlx >= brx || tly >= bry) return 0;
+
+	cv::Mat index = cv::Mat(bry-tly, brx-tlx, CV_32SC1, cv::Scalar(-1));
+	vector<int> pixels;
+	for(int y=tly; y<bry; y++) {
+		for(int x=tlx; x<brx; x++) {
+			if(mask.at<uchar>(y, x) != 0) {
+				index.at<int>(y-tly, x-tlx) = (int)pixels.size();
+				pixels.push_back(y * width + x);
+			}
+		}
+	}
+
+	const int n = (int)pixels.size();
+	if(n == 0) return 0;
+
+	// neighbours of each unknown (-1 for boundary pixels) and right hand side
+	vector<int> nbr(4 * n);
+	vector<float> b(n * dim), x(n * dim);
+	for(int i=0; i<n; i++) {
+		int px = pixels[i] % width;
+		int py = pixels[i] / width;
+		for(int c=0; c<dim; c++) {
+			b[i*dim+c] = -laplace.at<float>(py, px*dim+c);
+			x[i*dim+c] = res.at<float>(py, px*dim+c);
+		}
+		for(int k=0; k<4; k++) {
+			int xx = px + offset[k][0];
+			int yy = py + offset[k][1];
+			bool inside = xx >= tlx && yy >= tly && xx < brx && yy < bry;
+			nbr[i*4+k] = inside ? index.at<int>(yy-tly, xx-tlx) : -1;
+			if(nbr[i*4+k] < 0) {
+				for(int c=0; c<dim; c++) {
+					b[i*dim+c] += res.at<float>(yy, xx*dim+c);
 				}
 			}
 		}
 	}
 
+	// IC(0) of "4u - sum(u_nb)". west and north neighbours precede in raster order.
+	vector<float> diag(n);
+	for(int i=0; i<n; i++) {
+		float d = 4.0f;
+		if(nbr[i*4+0] >= 0) d -= 1.0f / diag[nbr[i*4+0]];
+		if(nbr[i*4+2] >= 0) d -= 1.0f / diag[nbr[i*4+2]];
+		diag[i] = d;
+	}
+
+	vector<float> r(n * dim), z(n * dim), p(n * dim), q(n * dim);
+	vector<double> rz(dim), rzNew(dim), pq(dim);
+
+	cgApply(x, q, nbr, dim);
+	for(int i=0; i<n*dim; i++) {
+		r[i] = b[i] - q[i];
+	}
+
+	int it;
+	for(it=0; it<maxIter; it++) {
+		float maxres = 0.0f;
+		for(int i=0; i<n*dim; i++) {
+			maxres = max(maxres, abs(r[i]));
+		}
+		if(maxres <= tol) break;
+
+		// z = M^-1 r (forward and backward substitution)
+		for(int i=0; i<n; i++) {
+			for(int c=0; c<dim; c++) {
+				float sum = r[i*dim+c];
+				if(nbr[i*4+0] >= 0) sum += z[nbr[i*4+0]*dim+c];
+				if(nbr[i*4+2] >= 0) sum += z[nbr[i*4+2]*dim+c];
+				z[i*dim+c] = sum / diag[i];
+			}
+		}
+		for(int i=n-1; i>=0; i--) {
+			for(int c=0; c<dim; c++) {
+				float sum = 0.0f;
+				if(nbr[i*4+1] >= 0) sum += z[nbr[i*4+1]*dim+c];
+				if(nbr[i*4+3] >= 0) sum += z[nbr[i*4+3]*dim+c];
+				z[i*dim+c] += sum / diag[i];
+			}
+		}
+
+		for(int c=0; c<dim; c++) rzNew[c] = 0.0;
+		for(int i=0; i<n; i++) {
+			for(int c=0; c<dim; c++) {
+				rzNew[c] += (double)r[i*dim+c] * z[i*dim+c];
+			}
+		}
+
+		// each channel is an independent system
+		for(int c=0; c<dim; c++) {
+			double beta = it == 0 ? 0.0 : rzNew[c] / rz[c];
+			for(int i=0; i<n; i++) {
+				p[i*dim+c] = z[i*dim+c] + (float)beta * p[i*dim+c];
+			}
+			rz[c] = rzNew[c];
+		}
+
+		cgApply(p, q, nbr, dim);
+		for(int c=0; c<dim; c++) pq[c] = 0.0;
+		for(int i=0; i<n; i++) {
+			for(int c=0; c<dim; c++) {
+				pq[c] += (double)p[i*dim+c] * q[i*dim+c];
+			}
+		}
+
+		for(int c=0; c<dim; c++) {
+			float alpha = pq[c] != 0.0 ? (float)(rz[c] / pq[c]) : 0.0f;
+			for(int i=0; i<n; i++) {
+				x[i*dim+c] += alpha * p[i*dim+c];
+				r[i*dim+c] -= alpha * q[i*dim+c];
+			}
+		}
+	}
+	cout << "  PCG: " << it << " iterations for " << n << " unknowns" << endl;
+
+	// write back solution and paint computed region
+	uchar color = rand() % 255;
+	for(int i=0; i<n; i++) {
+		int px = pixels[i] % width;
+		int py = pixels[i] / width;
+		for(int c=0; c<dim; c++) {
+			res.at<float>(py, px*dim+c) = x[i*dim+c];
+		}
+		region.at<uchar>(py, px) = color;
+	}
+	return it;
+}
+
+// DST-I along each row of a single channel matrix (unnormalized),
+// X_k = sum_j x_j sin(pi * j * k / (n+1)), taken from the DFT of the odd extension
+// [0, x_1 .. x_n, 0, -x_n .. -x_1] whose imaginary part is -2 X_k.
+void dstRows(cv::Mat& src, cv::Mat& dst) {
+	int rows = src.rows;
+	int n    = src.cols;
+	int N    = 2 * (n + 1);
+
+	cv::Mat ext = cv::Mat::zeros(rows, N, CV_32FC1);
+	for(int y=0; y<rows; y++) {
+		float* s = src.ptr<float>(y);
+		float* e = ext.ptr<float>(y);
+		for(int j=0; j<n; j++) {
+			e[j+1]   =  s[j];
+			e[N-1-j] = -s[j];
+		}
+	}
+
+	cv::Mat spec;
+	cv::dft(ext, spec, cv::DFT_ROWS | cv::DFT_COMPLEX_OUTPUT);
+
+	dst.create(rows, n, CV_32FC1);
+	for(int y=0; y<rows; y++) {
+		float* sp = spec.ptr<float>(y);
+		float* d  = dst.ptr<float>(y);
+		for(int k=0; k<n; k++) {
+			d[k] = -0.5f * sp[2*(k+1)+1];
+		}
+	}
+}
+
+// 2D DST-I (rows, then columns)
+void dst2D(cv::Mat& src, cv::Mat& dst) {
+	cv::Mat tmp;
+	dstRows(src, tmp);
+	cv::transpose(tmp, tmp);
+	dstRows(tmp, tmp);
+	cv::transpose(tmp, dst);
+}
+
+// solve poisson equation in the rectangle directly with the discrete sine transform.
+// the 5-point operator with Dirichlet boundary is diagonal in the DST-I basis, so
+// the boundary values are folded into the right hand side and each frequency is
+// divided by its eigenvalue. the image border is kept fixed.
+void solvePoissonDST(cv::Mat& base, cv::Mat& laplace, cv::Mat& res, int tlx, int tly, int brx, int bry, cv::Mat& region) {
+	int width = base.cols;
+	int height = base.rows;
+	int dim = base.channels();
+
+	if(res.empty()) {
+		base.convertTo(res, CV_MAKETYPE(CV_32F, dim));
+	}
+
+	tlx = max(tlx, 1);
+	tly = max(tly, 1);
+	brx = min(brx, width-1);
+	bry = min(bry, height-1);
+	if(tlx >= brx || tly >= bry) return;
+
+	int m = brx - tlx;
+	int n = bry - tly;
+
+	// eigenvalues of "4u - sum(u_nb)"
+	cv::Mat eigen = cv::Mat(n, m, CV_32FC1);
+	for(int q=0; q<n; q++) {
+		for(int p=0; p<m; p++) {
+			eigen.at<float>(q, p) = (float)(4.0 - 2.0 * cos(CV_PI * (p+1) / (m+1)) - 2.0 * cos(CV_PI * (q+1) / (n+1)));
+		}
+	}
+	float scale = 4.0f / ((m+1) * (n+1));
+
+	for(int c=0; c<dim; c++) {
+		// right hand side with boundary values folded in
+		cv::Mat b = cv::Mat(n, m, CV_32FC1);
+		for(int y=tly; y<bry; y++) {
+			for(int x=tlx; x<brx; x++) {
+				float sum = -laplace.at<float>(y, x*dim+c);
+				if(x == tlx)   sum += res.at<float>(y, (x-1)*dim+c);
+				if(x == brx-1) sum += res.at<float>(y, (x+1)*dim+c);
+				if(y == tly)   sum += res.at<float>(y-1, x*dim+c);
+				if(y == bry-1) sum += res.at<float>(y+1, x*dim+c);
+				b.at<float>(y-tly, x-tlx) = sum;
+			}
+		}
+
+		cv::Mat B, u;
+		dst2D(b, B);
+		for(int q=0; q<n; q++) {
+			float* bp = B.ptr<float>(q);
+			float* ep = eigen.ptr<float>(q);
+			for(int p=0; p<m; p++) {
+				bp[p] = bp[p] * scale / ep[p];
+			}
+		}
+		dst2D(B, u);
+
+		for(int y=tly; y<bry; y++) {
+			for(int x=tlx; x<brx; x++) {
+				res.at<float>(y, x*dim+c) = u.at<float>(y-tly, x-tlx);
+			}
+		}
+	}
+
 	// paint computed region
 	uchar color = rand() % 255;
 	for(int y=tly; y<bry; y++) {
@@ -72,11 +775,539 @@ void solvePoisson(cv::Mat& base, cv::Mat& laplace, cv::Mat& res, int tlx, int tl
 	}
 }
 
+// persistent compositor for interactive cloning. it keeps the last solution,
+// the guidance field and the unknown mask, and when the source is moved or its
+// mask is edited, only the pixels under the source are re-solved, starting
+// from the previous solution shifted with the source plus a plane fitted to the
+// change of its boundary values. this halves the PCG iterations for small drags
+// (see the "check" mode); after a large jump it is no better than a cold start.
+class PoissonCompositor {
+public:
+	PoissonCompositor(cv::Mat& base);
+
+	// source image and its mask (same size), pasted with top-left at (x, y)
+	void setSource(cv::Mat& source, cv::Mat& mask, int x, int y);
+	void moveTo(int x, int y);
+	void setMask(cv::Mat& mask);
+
+	cv::Mat& result() { return res; }
+	cv::Mat& solvedRegion() { return region; }
+	double lastTime() const { return elapsed; }
+	int lastIterations() const { return iterations; }
+
+private:
+	cv::Rect placed(int x, int y);
+	void remove();
+	void boundaryPlane(int prevx, int prevy, vector<float>& plane);
+	void paste(cv::Mat& prev, cv::Rect prevRect, int prevx, int prevy);
+	void solve();
+
+	cv::Mat base, lap_base;
+	cv::Mat source, lap_source, srcMask;
+	cv::Mat guidance, unknown, res, region;
+	int ox, oy;
+	double elapsed;
+	int iterations;
+};
+
+PoissonCompositor::PoissonCompositor(cv::Mat& base)
+	: ox(0), oy(0), elapsed(0.0), iterations(0)
+{
+	this->base = base;
+	cv::Laplacian(base, lap_base, CV_32F);
+	guidance = lap_base.clone();
+	unknown  = cv::Mat::zeros(base.size(), CV_8UC1);
+	region   = cv::Mat::zeros(base.size(), CV_8UC1);
+	res      = base.clone();
+}
+
+void PoissonCompositor::setSource(cv::Mat& source, cv::Mat& mask, int x, int y) {
+	double t0 = wallTime();
+	remove();
+	this->source = source;
+	cv::Laplacian(source, lap_source, CV_32F);
+	srcMask = mask.clone();
+	ox = x;
+	oy = y;
+
+	cv::Mat none;
+	paste(none, cv::Rect(), 0, 0);
+	solve();
+	elapsed = wallTime() - t0;
+}
+
+void PoissonCompositor::moveTo(int x, int y) {
+	double t0 = wallTime();
+	cv::Rect prevRect = placed(ox, oy);
+	cv::Mat prev = res(prevRect).clone();
+	int prevx = ox;
+	int prevy = oy;
+
+	remove();
+	ox = x;
+	oy = y;
+	paste(prev, prevRect, prevx, prevy);
+	solve();
+	elapsed = wallTime() - t0;
+}
+
+void PoissonCompositor::setMask(cv::Mat& mask) {
+	double t0 = wallTime();
+	cv::Rect prevRect = placed(ox, oy);
+	cv::Mat prev = res(prevRect).clone();
+
+	remove();
+	srcMask = mask.clone();
+	paste(prev, prevRect, ox, oy);
+	solve();
+	elapsed = wallTime() - t0;
+}
+
+// source rectangle clipped to the image
+cv::Rect PoissonCompositor::placed(int x, int y) {
+	int x0 = max(x, 0);
+	int y0 = max(y, 0);
+	int x1 = min(x + source.cols, base.cols);
+	int y1 = min(y + source.rows, base.rows);
+	if(x1 <= x0 || y1 <= y0) return cv::Rect();
+	return cv::Rect(x0, y0, x1-x0, y1-y0);
+}
+
+// restore base under the current source
+void PoissonCompositor::remove() {
+	if(source.empty()) return;
+
+	int dim = base.channels();
+	cv::Rect rect = placed(ox, oy);
+	for(int y=rect.y; y<rect.y+rect.height; y++) {
+		for(int x=rect.x; x<rect.x+rect.width; x++) {
+			if(unknown.at<uchar>(y, x) == 0) continue;
+			for(int c=0; c<dim; c++) {
+				res.at<float>(y, x*dim+c)      = base.at<float>(y, x*dim+c);
+				guidance.at<float>(y, x*dim+c) = lap_base.at<float>(y, x*dim+c);
+			}
+			unknown.at<uchar>(y, x) = 0;
+			region.at<uchar>(y, x)  = 0;
+		}
+	}
+}
+
+// least squares plane a + b*sx + c*sy (in source coordinates) through the change
+// of the boundary values, base(new) - base(old), over the pixels just outside
+// the mask. planes are harmonic, so adding it to the shifted solution moves it
+// most of the way towards the solution for the new boundary.
+void PoissonCompositor::boundaryPlane(int prevx, int prevy, vector<float>& plane) {
+	int dim = base.channels();
+	plane.assign(dim*3, 0.0f);
+	if(prevx == ox && prevy == oy) return;
+
+	double m[3][3] = {{0}};
+	vector<double> rhs(dim*3, 0.0);
+	static const int nb[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+	for(int sy=0; sy<srcMask.rows; sy++) {
+		for(int sx=0; sx<srcMask.cols; sx++) {
+			if(srcMask.at<uchar>(sy, sx) == 0) continue;
+			for(int k=0; k<4; k++) {
+				int nx = sx + nb[k][0];
+				int ny = sy + nb[k][1];
+				if(nx >= 0 && ny >= 0 && nx < srcMask.cols && ny < srcMask.rows && srcMask.at<uchar>(ny, nx) != 0) continue;
+				int x = ox + nx, y = oy + ny;
+				int px = prevx + nx, py = prevy + ny;
+				if(x < 0 || y < 0 || x >= base.cols || y >= base.rows) continue;
+				if(px < 0 || py < 0 || px >= base.cols || py >= base.rows) continue;
+
+				double v[3] = {1.0, (double)nx, (double)ny};
+				for(int i=0; i<3; i++) {
+					for(int j=0; j<3; j++) m[i][j] += v[i]*v[j];
+				}
+				for(int c=0; c<dim; c++) {
+					double d = base.at<float>(y, x*dim+c) - base.at<float>(py, px*dim+c);
+					for(int i=0; i<3; i++) rhs[c*3+i] += v[i]*d;
+				}
+			}
+		}
+	}
+	if(m[0][0] == 0.0) return;
+
+	// 3x3 normal equations by Cramer's rule, falling back to the mean when the
+	// boundary samples are (nearly) collinear
+	double det = m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+	           - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+	           + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+	for(int c=0; c<dim; c++) {
+		double* r = &rhs[c*3];
+		if(fabs(det) < 1e-9 * m[0][0]*m[1][1]*m[2][2]) {
+			plane[c*3] = (float)(r[0] / m[0][0]);
+			continue;
+		}
+		for(int i=0; i<3; i++) {
+			double a[3][3];
+			for(int row=0; row<3; row++) {
+				for(int col=0; col<3; col++) a[row][col] = (col == i) ? r[row] : m[row][col];
+			}
+			double di = a[0][0]*(a[1][1]*a[2][2] - a[1][2]*a[2][1])
+			          - a[0][1]*(a[1][0]*a[2][2] - a[1][2]*a[2][0])
+			          + a[0][2]*(a[1][0]*a[2][1] - a[1][1]*a[2][0]);
+			plane[c*3+i] = (float)(di / det);
+		}
+	}
+}
+
+// mark the source pixels as unknowns with the source gradient as guidance.
+// each pixel starts from the previous solution of the same source pixel
+// (placed at (prevx, prevy) inside "prevRect") corrected by the boundary plane,
+// or from base if it was not solved.
+// pixels on the image border are never solved, so they are held at base.
+void PoissonCompositor::paste(cv::Mat& prev, cv::Rect prevRect, int prevx, int prevy) {
+	int dim = base.channels();
+	cv::Rect rect = placed(ox, oy);
+	vector<float> plane;
+	if(!prev.empty()) boundaryPlane(prevx, prevy, plane);
+	for(int y=rect.y; y<rect.y+rect.height; y++) {
+		for(int x=rect.x; x<rect.x+rect.width; x++) {
+			int sx = x - ox;
+			int sy = y - oy;
+			if(srcMask.at<uchar>(sy, sx) == 0) continue;
+			if(x == 0 || y == 0 || x == base.cols-1 || y == base.rows-1) continue;
+
+			int px = sx + prevx - prevRect.x;
+			int py = sy + prevy - prevRect.y;
+			bool warm = px >= 0 && py >= 0 && px < prevRect.width && py < prevRect.height;
+			for(int c=0; c<dim; c++) {
+				guidance.at<float>(y, x*dim+c) = lap_source.at<float>(sy, sx*dim+c);
+				if(warm) {
+					const float* p = &plane[c*3];
+					res.at<float>(y, x*dim+c) = prev.at<float>(py, px*dim+c) + p[0] + p[1]*sx + p[2]*sy;
+				} else {
+					res.at<float>(y, x*dim+c) = base.at<float>(y, x*dim+c);
+				}
+			}
+			unknown.at<uchar>(y, x) = 255;
+		}
+	}
+}
+
+// re-solve around the source only. pixels outside the mask keep base values
+// and act as the Dirichlet boundary.
+void PoissonCompositor::solve() {
+	cv::Rect rect = placed(ox, oy);
+	if(rect.area() == 0) return;
+
+	int x0 = max(rect.x - 1, 0);
+	int y0 = max(rect.y - 1, 0);
+	int x1 = min(rect.x + rect.width + 1, base.cols);
+	int y1 = min(rect.y + rect.height + 1, base.rows);
+	cv::Rect roi(x0, y0, x1-x0, y1-y0);
+
+	cv::Mat subBase = base(roi);
+	cv::Mat subGuidance = guidance(roi);
+	cv::Mat subUnknown = unknown(roi);
+	cv::Mat subRes = res(roi);
+	cv::Mat subRegion = region(roi);
+	iterations = solvePoissonMaskedCG(subBase, subGuidance, subUnknown, subRes, subRegion);
+}
+
+// one pasted source for the batched compositing
+struct PoissonInsert {
+	cv::Mat source;	// CV_32FC3
+	cv::Mat mask;	// CV_8UC1, same size as source
+	int x, y;		// top-left position in base
+};
+
+// read inserts listed as "[source image] [mask image] [x] [y]" per line
+bool loadInserts(const char* filename, vector<PoissonInsert>& inserts) {
+	ifstream ifs(filename);
+	if(!ifs.is_open()) {
+		cout << "Failed to open insert list \"" << filename << "\"" << endl;
+		return false;
+	}
+
+	string srcname, maskname;
+	PoissonInsert ins;
+	while(ifs >> srcname >> maskname >> ins.x >> ins.y) {
+		ins.source = cv::imread(srcname, CV_LOAD_IMAGE_COLOR);
+		ins.mask   = cv::imread(maskname, CV_LOAD_IMAGE_GRAYSCALE);
+		if(ins.source.empty() || ins.mask.empty()) {
+			cout << "Failed to load insert \"" << srcname << "\", \"" << maskname << "\"" << endl;
+			return false;
+		}
+		if(ins.source.size() != ins.mask.size()) {
+			cout << "Size of source and mask is different: \"" << srcname << "\"" << endl;
+			return false;
+		}
+		ins.source.convertTo(ins.source, CV_32FC3, 1.0 / 255.0);
+		inserts.push_back(ins);
+	}
+	return true;
+}
+
+int findGroup(vector<int>& parent, int i) {
+	while(parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+// paste all inserts into base with a single combined guidance field.
+// inserts whose rectangles touch are merged into one group, and the groups,
+// which share no unknowns or boundary pixels, are solved in parallel.
+void compositeInserts(cv::Mat& base, vector<PoissonInsert>& inserts, cv::Mat& res, cv::Mat& region) {
+	int width = base.cols;
+	int height = base.rows;
+	int dim = base.channels();
+	int n = (int)inserts.size();
+	cv::Rect image(0, 0, width, height);
+
+	// combined guidance field and unknowns (later inserts overwrite earlier ones)
+	cv::Mat guidance = cv::Mat::zeros(height, width, CV_MAKETYPE(CV_32F, dim));
+	cv::Mat owner = cv::Mat(height, width, CV_32SC1, cv::Scalar(-1));
+	vector<cv::Rect> rects(n);
+	for(int i=0; i<n; i++) {
+		PoissonInsert& ins = inserts[i];
+		cv::Mat lap;
+		cv::Laplacian(ins.source, lap, CV_32F);
+
+		rects[i] = cv::Rect(ins.x, ins.y, ins.source.cols, ins.source.rows) & image;
+		for(int y=rects[i].y; y<rects[i].y+rects[i].height; y++) {
+			for(int x=rects[i].x; x<rects[i].x+rects[i].width; x++) {
+				int sx = x - ins.x;
+				int sy = y - ins.y;
+				if(ins.mask.at<uchar>(sy, sx) == 0) continue;
+				for(int c=0; c<dim; c++) {
+					guidance.at<float>(y, x*dim+c) = lap.at<float>(sy, sx*dim+c);
+				}
+				owner.at<int>(y, x) = i;
+			}
+		}
+	}
+
+	// group inserts whose rectangles (with one pixel of boundary) touch
+	vector<int> parent(n);
+	for(int i=0; i<n; i++) parent[i] = i;
+	for(int i=0; i<n; i++) {
+		cv::Rect ri(rects[i].x-1, rects[i].y-1, rects[i].width+2, rects[i].height+2);
+		for(int j=i+1; j<n; j++) {
+			if((ri & rects[j]).area() != 0) {
+				parent[findGroup(parent, j)] = findGroup(parent, i);
+			}
+		}
+	}
+
+	vector<int> groupId(n, -1);
+	vector<cv::Rect> groups;
+	for(int i=0; i<n; i++) {
+		if(rects[i].area() == 0) continue;
+		int g = findGroup(parent, i);
+		if(groupId[g] < 0) {
+			groupId[g] = (int)groups.size();
+			groups.push_back(rects[i]);
+		}
+		groups[groupId[g]] |= rects[i];
+	}
+
+	cv::Mat label = cv::Mat(height, width, CV_32SC1, cv::Scalar(-1));
+	for(int y=0; y<height; y++) {
+		for(int x=0; x<width; x++) {
+			int i = owner.at<int>(y, x);
+			if(i >= 0) label.at<int>(y, x) = groupId[findGroup(parent, i)];
+		}
+	}
+	cout << n << " inserts in " << groups.size() << " independent regions" << endl;
+
+	// solve every region once
+	res = base.clone();
+	region = cv::Mat::zeros(height, width, CV_8UC1);
+	const int ngroups = (int)groups.size();
+
+	#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+	#endif
+	for(int g=0; g<ngroups; g++) {
+		cv::Rect roi = cv::Rect(groups[g].x-1, groups[g].y-1, groups[g].width+2, groups[g].height+2) & image;
+		cv::Mat subBase = base(roi);
+		cv::Mat subGuidance = guidance(roi);
+		cv::Mat subMask = label(roi) == g;
+		cv::Mat subRes = res(roi);
+		cv::Mat subRegion = region(roi);
+		solvePoissonMaskedCG(subBase, subGuidance, subMask, subRes, subRegion);
+	}
+}
+
+// mask of the pixels where blend differs from base, with its bounding box, in one pass
+cv::Rect differenceMask(cv::Mat& base, cv::Mat& blend, cv::Mat& mask) {
+	int width = base.cols;
+	int height = base.rows;
+	int dim = base.channels();
+
+	int tlx = width, tly = height, brx = 0, bry = 0;
+	mask = cv::Mat(height, width, CV_8UC1);
+	for(int y=0; y<height; y++) {
+		float* bp = base.ptr<float>(y);
+		float* sp = blend.ptr<float>(y);
+		uchar* mp = mask.ptr<uchar>(y);
+		for(int x=0; x<width; x++) {
+			bool is_same = true;
+			for(int c=0; c<dim; c++) {
+				if(bp[x*dim+c] != sp[x*dim+c]) {
+					is_same = false;
+					break;
+				}
+			}
+			mp[x] = is_same ? 0 : 255;
+			if(!is_same) {
+				tlx = min(tlx, x);
+				tly = min(tly, y);
+				brx = max(brx, x+1);
+				bry = max(bry, y+1);
+			}
+		}
+	}
+	return brx > tlx ? cv::Rect(tlx, tly, brx-tlx, bry-tly) : cv::Rect();
+}
+
+// guidance field inside "roi": laplacian of blend, except within r pixels
+// of an unchanged pixel where the laplacian of base is used. the unchanged
+// pixels are dilated with a separable (2r+1) box.
+void composeGuidance(cv::Mat& base, cv::Mat& blend, cv::Mat& diff, cv::Rect roi, cv::Mat& laplace) {
+	cv::Mat lap_base;
+	cv::Laplacian(blend(roi), laplace, CV_32F);
+	cv::Laplacian(base(roi), lap_base, CV_32F);
+
+	cv::Mat same = diff(roi) == 0;
+	cv::dilate(same, same, cv::Mat::ones(1, 2*r+1, CV_8UC1));
+	cv::dilate(same, same, cv::Mat::ones(2*r+1, 1, CV_8UC1));
+	lap_base.copyTo(laplace, same);
+}
+
+// synthetic base and guidance field of the given size for the self checks
+void checkProblem(int width, int height, cv::Mat& base, cv::Mat& laplace) {
+	base = cv::Mat(height, width, CV_32FC3);
+	laplace = cv::Mat(height, width, CV_32FC3);
+	for(int y=0; y<height; y++) {
+		for(int x=0; x<width; x++) {
+			for(int c=0; c<3; c++) {
+				base.at<float>(y, x*3+c) = 0.5f + 0.4f * (float)sin(0.07 * x + 0.05 * y + c);
+				laplace.at<float>(y, x*3+c) = 0.05f * (float)cos(0.31 * x * (c+1) - 0.17 * y);
+			}
+		}
+	}
+}
+
+// self checks of the solvers on synthetic problems. returns the number of failures.
+int runChecks() {
+	int failed = 0;
+
+	// multigrid must converge in a few cycles for any size, not only 2^k+1
+	const int sizes[4][2] = { {66, 66}, {258, 130}, {1026, 10}, {9, 400} };
+	for(int i=0; i<4; i++) {
+		int width = sizes[i][0] + 2;
+		int height = sizes[i][1] + 2;
+		cv::Mat base, laplace, res;
+		checkProblem(width, height, base, laplace);
+		cv::Mat region = cv::Mat::zeros(height, width, CV_8UC1);
+		int cycles = solvePoissonMultigrid(base, laplace, res, 1, 1, width-1, height-1, region);
+		bool ok = cycles <= 5;
+		printf("[%s] multigrid %d x %d: %d cycles\n", ok ? "PASS" : "FAIL", width-2, height-2, cycles);
+		if(!ok) failed++;
+	}
+
+	// a warm-started move must give the same result as a cold solve at the
+	// destination, also when the source hangs over the image border
+	{
+		int width = 160, height = 120;
+		cv::Mat base, laplace;
+		checkProblem(width, height, base, laplace);
+		cv::Mat source = cv::Mat(50, 60, CV_32FC3);
+		cv::Mat srcMask = cv::Mat::zeros(50, 60, CV_8UC1);
+		for(int y=0; y<source.rows; y++) {
+			for(int x=0; x<source.cols; x++) {
+				for(int c=0; c<3; c++) {
+					source.at<float>(y, x*3+c) = 0.5f + 0.4f * (float)cos(0.3 * y + 0.2 * x + c);
+				}
+				int dx = x - 30, dy = y - 25;
+				if(dx * dx + 2 * dy * dy < 900) srcMask.at<uchar>(y, x) = 255;
+			}
+		}
+
+		const int dest[3][2] = { {100, 80}, {-10, 40}, {110, -5} };
+		for(int i=0; i<3; i++) {
+			PoissonCompositor warm(base), cold(base);
+			warm.setSource(source, srcMask, 40, 30);
+			warm.moveTo(dest[i][0], dest[i][1]);
+			cold.setSource(source, srcMask, dest[i][0], dest[i][1]);
+
+			double maxdiff = 0.0;
+			for(int y=0; y<height; y++) {
+				for(int x=0; x<width*3; x++) {
+					maxdiff = max(maxdiff, (double)abs(warm.result().at<float>(y, x) - cold.result().at<float>(y, x)));
+				}
+			}
+			bool ok = maxdiff * 255.0 < 0.5;	// both stop at cgTol, so allow less than half an 8-bit level
+			printf("[%s] warm vs cold move to (%d, %d): max diff %.4f / 255\n", ok ? "PASS" : "FAIL", dest[i][0], dest[i][1], maxdiff * 255.0);
+			if(!ok) failed++;
+		}
+	}
+
+	// dragging in small steps: per-move latency and PCG iterations of the
+	// warm-started compositor against a cold solve at every position
+	{
+		int width = 400, height = 300;
+		cv::Mat base, laplace;
+		checkProblem(width, height, base, laplace);
+		cv::Mat source = cv::Mat(120, 150, CV_32FC3);
+		cv::Mat srcMask = cv::Mat::zeros(120, 150, CV_8UC1);
+		for(int y=0; y<source.rows; y++) {
+			for(int x=0; x<source.cols; x++) {
+				for(int c=0; c<3; c++) {
+					source.at<float>(y, x*3+c) = 0.5f + 0.4f * (float)cos(0.1 * y + 0.07 * x + c);
+				}
+				int dx = x - 75, dy = y - 60;
+				if(dx * dx + 2 * dy * dy < 4900) srcMask.at<uchar>(y, x) = 255;
+			}
+		}
+
+		const int moves = 20;
+		PoissonCompositor warm(base);
+		warm.setSource(source, srcMask, 40, 30);
+		double warmTime = 0.0, coldTime = 0.0;
+		int warmIters = 0, coldIters = 0;
+		for(int i=1; i<=moves; i++) {
+			warm.moveTo(40 + 2*i, 30 + i);
+			warmTime += warm.lastTime();
+			warmIters += warm.lastIterations();
+
+			PoissonCompositor cold(base);
+			cold.setSource(source, srcMask, 40 + 2*i, 30 + i);
+			coldTime += cold.lastTime();
+			coldIters += cold.lastIterations();
+		}
+		bool ok = warmIters < coldIters;
+		printf("[%s] drag %d moves of (2, 1): warm %.2f ms %.1f iterations, cold %.2f ms %.1f iterations per move\n",
+			ok ? "PASS" : "FAIL", moves, warmTime * 1000.0 / moves, (double)warmIters / moves, coldTime * 1000.0 / moves, (double)coldIters / moves);
+		if(!ok) failed++;
+	}
+
+	return failed;
+}
+
 int main(int argc, char** argv) {
+	if(argc > 1 && string(argv[1]) == "check") {
+		return runChecks() == 0 ? 0 : 1;
+	}
 	if(argc <= 2) {
-		cout << "usage: PoissonImageEditing.exe [base image] [blend image]" << endl;
+		cout << "usage: PoissonImageEditing.exe [base image] [blend image] ([solver] [mask image])" << endl;
+		cout << "       PoissonImageEditing.exe [base image] [insert list] batch" << endl;
+		cout << "       PoissonImageEditing.exe check (self checks of the solvers)" << endl;
+		cout << "  solver: auto (default, same as dst), dst (direct DST), mg (multigrid), sor (red-black SOR)," << endl;
+		cout << "          gs (adaptive Gauss-Seidel): all of them solve the whole interior of the padded ROI," << endl;
+		cout << "          cg (PCG only inside the mask, the rest of the ROI keeps base; without a mask image," << endl;
+		cout << "              the mask is the pixels where blend differs from base)," << endl;
+		cout << "          drag (interactive demo: moves the edited region with warm-started re-solves)" << endl;
+		cout << "  insert list: \"[source image] [mask image] [x] [y]\" per line" << endl;
 		return -1;
 	}
+	string solver = argc > 3 ? argv[3] : "auto";
 
 	cv::Mat base = cv::imread(argv[1], CV_LOAD_IMAGE_COLOR);
 	if(base.empty()) {
@@ -84,6 +1315,29 @@ int main(int argc, char** argv) {
 		return -1;
 	}
 
+	// paste all listed inserts in a single solve
+	if(solver == "batch") {
+		base.convertTo(base, CV_32FC3, 1.0 / 255.0);
+		vector<PoissonInsert> inserts;
+		if(!loadInserts(argv[2], inserts)) {
+			return -1;
+		}
+
+		cv::Mat res, region;
+		double t0 = wallTime();
+		compositeInserts(base, inserts, res, region);
+		printf("  %.1f ms\n", (wallTime() - t0) * 1000.0);
+
+		cv::namedWindow("Result");
+		cv::imshow("Result", res);
+		res.convertTo(res, CV_32FC3, 255.0);
+		cv::imwrite("result.png", res);
+		cv::imwrite("region.png", region);
+		cv::waitKey(0);
+		cv::destroyAllWindows();
+		return 0;
+	}
+
 	cv::Mat blend = cv::imread(argv[2], CV_LOAD_IMAGE_COLOR);
 	if(blend.empty()) {
 		cout << "Failed to load image file \"" << argv[2] << "\"" << endl;
@@ -92,7 +1346,6 @@ int main(int argc, char** argv) {
 
 	int width = base.cols;
 	int height = base.rows;
-	int dim = base.channels();
 	if(width != blend.cols || height != blend.rows) {
 		cout << "Size of base and blend is different." << endl;
 		return -1;
@@ -101,44 +1354,94 @@ int main(int argc, char** argv) {
 	base.convertTo(base, CV_32FC3, 1.0 / 255.0);
 	blend.convertTo(blend, CV_32FC3, 1.0 / 255.0);
 
-	cv::Mat laplace, lap_base;
-	cv::Laplacian(blend, laplace, CV_32FC3);
-	cv::Laplacian(base, lap_base, CV_32FC3);
+	// find edited region
+	cv::Mat mask, diff;
+	cv::Rect box = differenceMask(base, blend, diff);
+	mask = diff;
 
-	cv::Mat mask = cv::Mat(height, width, CV_8UC1);
-	for(int y=0; y<height; y++) {
-		for(int x=0; x<width; x++) {
-			bool is_same = true;
-			for(int c=0; c<dim; c++) {
-				float base_val = base.at<float>(y, x*dim+c);
-				float blend_val = blend.at<float>(y, x*dim+c);
-				if(base_val != blend_val) {
-					is_same =false;
-					break;
-				}
-			}			
-
-			if(is_same) {
-				for(int dy=-r; dy<=r; dy++) {
-					for(int dx=-r; dx<=r; dx++) {
-						int xx = x + dx;
-						int yy = y + dy;
-						if(xx >= 0 && yy >= 0 && xx < width && yy < height) {
-							for(int c=0; c<dim; c++) {
-								laplace.at<float>(yy, xx*dim+c) = lap_base.at<float>(yy, xx*dim+c);
-							}
-						}
-					}
-				}
-			}
+	// explicit mask overrides the pixels where blend differs from base
+	if(argc > 4) {
+		mask = cv::imread(argv[4], CV_LOAD_IMAGE_GRAYSCALE);
+		if(mask.empty()) {
+			cout << "Failed to load image file \"" << argv[4] << "\"" << endl;
+			return -1;
+		}
+		if(mask.cols != width || mask.rows != height) {
+			cout << "Size of base and mask is different." << endl;
+			return -1;
 		}
+
+		int tlx, tly, brx, bry;
+		maskBoundingBox(mask, tlx, tly, brx, bry);
+		box = brx > tlx ? cv::Rect(tlx, tly, brx-tlx, bry-tly) : cv::Rect();
 	}
 
-	// solve poisson equation with Gauss-Seidel method.
 	srand((unsigned long)time(NULL));
 	cv::Mat region = cv::Mat::zeros(height, width, CV_8UC1);
-	cv::Mat res;
-	solvePoisson(base, laplace, res, 1, 1, width-1, height-1, region, 0, 8);
+	cv::Mat res = base.clone();
+	if(solver == "drag" && box.area() != 0) {
+		// paste the edited region as a source and drag it to the right
+		cv::Mat source = blend(box).clone();
+		cv::Mat srcMask = mask(box).clone();
+		PoissonCompositor compositor(base);
+		compositor.setSource(source, srcMask, box.x, box.y);
+		printf("  initial solve: %.1f ms\n", compositor.lastTime() * 1000.0);
+
+		cv::namedWindow("Result");
+		for(int i=1; i<=20; i++) {
+			compositor.moveTo(box.x + 2*i, box.y);
+			printf("  move %2d: %.1f ms, %d iterations\n", i, compositor.lastTime() * 1000.0, compositor.lastIterations());
+			cv::imshow("Result", compositor.result());
+			cv::waitKey(30);
+		}
+		compositor.result().copyTo(res);
+		compositor.solvedRegion().copyTo(region);
+	} else if(box.area() != 0) {
+		// pad the bounding box so that its outer ring is unchanged base pixels
+		int pad = r + 2;
+		int rx0 = max(box.x - pad, 0);
+		int ry0 = max(box.y - pad, 0);
+		int rx1 = min(box.x + box.width + pad, width);
+		int ry1 = min(box.y + box.height + pad, height);
+		cv::Rect roi(rx0, ry0, rx1-rx0, ry1-ry0);
+		cout << "ROI: " << roi.width << " x " << roi.height << " at (" << roi.x << ", " << roi.y << ")" << endl;
+
+		cv::Mat laplace;
+		composeGuidance(base, blend, diff, roi, laplace);
+
+		// solve poisson equation only inside the ROI
+		cv::Mat subBase = base(roi);
+		cv::Mat subMask = mask(roi);
+		cv::Mat subRegion = region(roi);
+		int subw = roi.width;
+		int subh = roi.height;
+
+		// the ROI interior is always a rectangle, so by default it is solved directly.
+		// all solvers but cg solve the same problem on the ROI interior.
+		if(solver == "auto") {
+			solver = "dst";
+			cout << "solver: " << solver << endl;
+		}
+
+		cv::Mat subRes;
+		if(solver == "gs") {
+			solvePoisson(subBase, laplace, subRes, 1, 1, subw-1, subh-1, subRegion, 8);
+		} else if(solver == "mg") {
+			solvePoissonMultigrid(subBase, laplace, subRes, 1, 1, subw-1, subh-1, subRegion);
+		} else if(solver == "sor") {
+			solvePoissonSOR(subBase, laplace, subRes, 1, 1, subw-1, subh-1, subRegion);
+		} else if(solver == "dst") {
+			solvePoissonDST(subBase, laplace, subRes, 1, 1, subw-1, subh-1, subRegion);
+		} else if(solver == "cg") {
+			solvePoissonMaskedCG(subBase, laplace, subMask, subRes, subRegion);
+		} else {
+			cout << "Unknown solver \"" << solver << "\"" << endl;
+			return -1;
+		}
+
+		// paste back
+		subRes.copyTo(res(roi));
+	}
 
 	cv::namedWindow("Base");
 	cv::imshow("Base", base);
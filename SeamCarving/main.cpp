@@ -11,6 +11,11 @@
 *
 * g
 * > SeamCarving.exe [input image] [No. of carved seams]
+* [h3ł͑SĂseam̏Ԃ [input image].seams.png ɕۑA
+* ȍ~͔Cӂ̉̉摜1pXō܂ (2{܂Ŋg\)B
+* Ԃ16bitŕۑ邽߁A[h3͉65536܂ł̉摜Ɍ܂B
+* [h6ł̓GlM[̃s~bh̑eiseamTAׂił
+* ̎̑т̒T܂ ([h1S𑜓xł̌ȕ@ł)B
 * 
 * Copyright:
 * This program is coded by tatsy. You can use this code
@@ -19,24 +24,47 @@
 
 #include <iostream>
 #include <list>
+#include <string>
 #include <vector>
+#include <algorithm>
+#include <cstring>
 using namespace std;
 
 #include <opencv2\opencv.hpp>
 
 int mode;   // k邩g傷邩̃[hI
-int npix;   // 傫ύXsNZ
+int npix;   // 傫ύXsNZ ([h3ł͕ύX̉)
 
 const int INF = 1 << 16;
 
+int nbatch;                     // [h41̓Iv@seam̐
+const double batchSlack = 0.25; // ܂Ƃ߂čseam̃GlM[̏ (ŏseam1.25{)
+
+const int pyramidLevels  = 2;   // [h6seamTs~bh̒i
+const int pyramidMinSize = 32;  // s~bh̍łei̍ŏ̏c̑傫
+const int seamBand       = 8;   // eiseam̎ŒTт̕ (Б)
+
 void description() {
     cout << "*** Seam Carving ***" << endl;
     cout << "  [1] shrinking" << endl;
     cout << "  [2] enlarging" << endl;
-    cout << "  choose mode [1 or 2]: ";
+    cout << "  [3] retargeting with seam index map" << endl;
+    cout << "  [4] fast shrinking (k seams per pass)" << endl;
+    cout << "  [5] benchmark of fast shrinking (k = 1, 4, 16, 64)" << endl;
+    cout << "  [6] fast shrinking (coarse-to-fine seam search)" << endl;
+    cout << "  choose mode [1-6]: ";
     cin >> mode;
-    cout << "  how many pixels?: ";
+    if(mode == 3) {
+        cout << "  target width?: ";
+    } else {
+        cout << "  how many pixels?: ";
+    }
     cin >> npix;
+    if(mode == 4) {
+        cout << "  how many seams per pass?: ";
+        cin >> nbatch;
+        nbatch = max(nbatch, 1);
+    }
 }
 
 void detectEdge(cv::InputArray img, cv::OutputArray edge) {
@@ -62,73 +90,524 @@ void detectEdge(cv::InputArray img, cv::OutputArray edge) {
     }
 }
 
+// O[XP[摜(x, y)ɂGlM[
+// (detectEdgeƓSobeľʂ8bitɊۂ߂Ăz̑傫vZ)
+uchar edgeEnergy(const cv::Mat& gray, int x, int y) {
+    const int width  = gray.cols;
+    const int height = gray.rows;
+
+    // Ecv::SobelƓ܂Ԃ(BORDER_REFLECT_101)
+    int xs[3], ys[3];
+    for(int d=-1; d<=1; d++) {
+        int xx = x + d;
+        int yy = y + d;
+        xs[d+1] = xx < 0 ? -xx : (xx >= width  ? 2*width-2-xx  : xx);
+        ys[d+1] = yy < 0 ? -yy : (yy >= height ? 2*height-2-yy : yy);
+    }
+    if(width  == 1) xs[0] = xs[2] = 0;
+    if(height == 1) ys[0] = ys[2] = 0;
+
+    int dx = 0, dy = 0;
+    const int w[3] = { 1, 2, 1 };
+    for(int k=0; k<3; k++) {
+        dx += w[k] * (gray.at<uchar>(ys[k], xs[2]) - gray.at<uchar>(ys[k], xs[0]));
+        dy += w[k] * (gray.at<uchar>(ys[2], xs[k]) - gray.at<uchar>(ys[0], xs[k]));
+    }
+    double gx = cv::saturate_cast<uchar>(dx);
+    double gy = cv::saturate_cast<uchar>(dy);
+    return cv::saturate_cast<uchar>(sqrt(gx * gx + gy * gy));
+}
+
+// seam菜O[XP[摜ƃGlM[A
+// seamɗאڂSobel̋ߖTςf̃GlM[vZ
+void updateEdge(cv::Mat& gray, cv::Mat& edge, vector<int>& seam) {
+    const int width  = gray.cols;
+    const int height = gray.rows;
+    for(int y=0; y<height; y++) {
+        // ㉺̍sseam͍X1fȂ̂ŁA[seam-3, seam+2]͈̔͂ŏ\
+        int x0 = max(0, seam[y] - 3);
+        int x1 = min(width-1, seam[y] + 2);
+        for(int x=x0; x<=x1; x++) {
+            edge.at<uchar>(y, x) = edgeEnergy(gray, x, y);
+        }
+    }
+}
+
+// ݐσGlM[𓮓Iv@ŋ߂
+// M(y, x) = e(y, x) + min(M(y-1, x-1), M(y-1, x), M(y-1, x+1))
+// es1sOɂˑȂ̂ŁAs̒SIMDƃXbhŕɌvZ
+// (table͍E1fԕu height x (width+2) ̕\)
+const int PAD = INT_MAX / 2;
+
+void cumulativeEnergy(cv::Mat& e, cv::Mat& table) {
+    const int width  = e.cols;
+    const int height = e.rows;
+
+    // ԕ̂ŁA͈̓`FbNȂ3ߖT̍ŏlƂ
+    table = cv::Mat(height, width+2, CV_32SC1);
+    for(int y=0; y<height; y++) {
+        table.at<int>(y, 0)       = PAD;
+        table.at<int>(y, width+1) = PAD;
+    }
+    for(int x=0; x<width; x++) {
+        table.at<int>(0, x+1) = e.at<uchar>(0, x);
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel if(width >= 2048)
+#endif
+    for(int y=1; y<height; y++) {
+        const int*   p  = table.ptr<int>(y-1) + 1;
+        int*         t  = table.ptr<int>(y) + 1;
+        const uchar* ep = e.ptr<uchar>(y);
+#if defined(_OPENMP) && _OPENMP >= 201307
+#pragma omp for simd schedule(static)
+#elif defined(_OPENMP)
+#pragma omp for schedule(static)
+#endif
+        for(int x=0; x<width; x++) {
+            t[x] = ep[x] + min(p[x-1], min(p[x], p[x+1]));
+        }
+    }
+}
+
+// ŏGlM[seam߂
 void computeSeam(cv::InputArray edge, vector<int>& seam) {
     cv::Mat e = edge.getMat();
     const int width  = e.cols;
     const int height = e.rows;
 
     // Iv@̎s
-	cv::Mat table = cv::Mat(height, width, CV_32SC1);
-    cv::Mat prev  = cv::Mat(height, width, CV_32SC1);
-	for(int x=0; x<width; x++) {
-        table.at<int>(0, x) = e.at<uchar>(0, x);
-         prev.at<int>(0, x) = 0;
-    }
-
-	for(int y=1; y<height; y++) {
-		for(int x=0; x<width; x++) {
-			int id = -1;
-			int minval = INT_MAX;
-			for(int dx=-1; dx<=1; dx++) {
-				int xx = x + dx;
-				if(xx >= 0 && xx < width) {
-					if(minval > e.at<uchar>(y-1, xx)) {
-						minval = e.at<uchar>(y-1, xx);
-						id = dx;
-					}
-				}
-			}
-			prev.at<int>(y, x)  = id;
-			table.at<int>(y, x) = table.at<int>(y-1, x+id);
-		}
-	}
+    cv::Mat table;
+    cumulativeEnergy(e, table);
 
     // obNgbNɂseam̌
+    // (1s3ߖT̂ݐσGlM[ŏ̉fǂ)
     seam.resize(height);
     int minval = INT_MAX;
     int cur_x  = 0;
     for(int x=0; x<width; x++) {
-        if(minval > table.at<int>(height-1, x)) {
-            minval = table.at<int>(height-1, x);
+        if(minval > table.at<int>(height-1, x+1)) {
+            minval = table.at<int>(height-1, x+1);
+            cur_x = x;
+        }
+    }
+
+    seam[height-1] = cur_x;
+    for(int y=height-2; y>=0; y--) {
+        const int* p = table.ptr<int>(y) + 1;
+        int id = -1;
+        if(p[cur_x] < p[cur_x+id]) id = 0;
+        if(p[cur_x+1] < p[cur_x+id]) id = 1;
+        cur_x += id;
+        seam[y] = cur_x;
+    }
+}
+
+// GlM[2x2f̕ςŏcɏk
+// fromɂׂ͍i̊esőO񂩂ςŏ̗nAhalf̗͂񂩂E
+// 蒼 (fromȂŜ)BĂяofrom͑eił̗ɂȂB
+// seamƕ1̂ŁAhalf̓obt@̂܂܂ɕk߂wb_ɂB
+void downsampleEnergy(cv::Mat& e, cv::Mat& half, vector<int>& from) {
+    const int width  = (e.cols + 1) / 2;
+    const int height = (e.rows + 1) / 2;
+    if(from.empty() || half.rows != height || half.cols < width) {
+        half.create(height, width, CV_8UC1);
+        from.assign(e.rows, 0);
+    } else {
+        half = half(cv::Rect(0, 0, width, height));
+    }
+
+    vector<int> next(height);
+    for(int y=0; y<height; y++) {
+        next[y] = min(from[2*y], from[min(2*y+1, e.rows-1)]) / 2;
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int y=0; y<height; y++) {
+        const uchar* e0 = e.ptr<uchar>(2*y);
+        const uchar* e1 = e.ptr<uchar>(min(2*y+1, e.rows-1));
+        uchar* h = half.ptr<uchar>(y);
+        const int n = e.cols / 2;
+        for(int x=next[y]; x<n; x++) {
+            h[x] = (uchar)((e0[2*x] + e0[2*x+1] + e1[2*x] + e1[2*x+1] + 2) >> 2);
+        }
+        // ̂Ƃ̉E[
+        if(n < width) {
+            h[n] = (uchar)((e0[2*n] + e1[2*n] + 1) >> 1);
+        }
+    }
+    from.swap(next);
+}
+
+// 1ie𑜓xseam (coarse) 2{Ɋg債A̎}bandf̑т̒
+// Iv@蒼seam߂Bт̊O͔ԕƂĈB
+// т̒ŏ[܂łȂȂfalseԂ
+bool refineSeam(cv::Mat& e, vector<int>& coarse, int band, vector<int>& seam) {
+    const int width  = e.cols;
+    const int height = e.rows;
+    const int bw     = 2 * band + 2;
+
+    // es̑т͈̔ [lo, lo+bw)
+    vector<int> lo(height);
+    for(int y=0; y<height; y++) {
+        int c = 2 * coarse[min(y/2, (int)coarse.size()-1)];
+        lo[y] = max(0, min(c - band, width - bw));
+    }
+
+    // т̗̒ݐσGlM[ (Eɔԕ)
+    cv::Mat table = cv::Mat(height, bw+2, CV_32SC1, cv::Scalar(PAD));
+    for(int x=0; x<bw && lo[0]+x<width; x++) {
+        table.at<int>(0, x+1) = e.at<uchar>(0, lo[0]+x);
+    }
+    for(int y=1; y<height; y++) {
+        const int*   p  = table.ptr<int>(y-1) + 1;
+        int*         t  = table.ptr<int>(y) + 1;
+        const uchar* ep = e.ptr<uchar>(y) + lo[y];
+        const int    d  = lo[y] - lo[y-1];
+        for(int x=0; x<bw && lo[y]+x<width; x++) {
+            // 1sȎтł̈ʒu (т̊O͔ԕ)
+            int px = x + d;
+            int m  = PAD;
+            for(int dx=-1; dx<=1; dx++) {
+                if(px+dx >= -1 && px+dx <= bw) m = min(m, p[px+dx]);
+            }
+            t[x] = ep[x] + m;
+        }
+    }
+
+    // obNgbN (computeSeamƓ3ߖTׂ)
+    seam.resize(height);
+    int minval = PAD;
+    int cur_x  = -1;
+    for(int x=0; x<bw; x++) {
+        if(minval > table.at<int>(height-1, x+1)) {
+            minval = table.at<int>(height-1, x+1);
             cur_x = x;
         }
     }
+    if(cur_x < 0) return false;
+
+    seam[height-1] = lo[height-1] + cur_x;
+    for(int y=height-2; y>=0; y--) {
+        const int* p = table.ptr<int>(y) + 1;
+        int px = seam[y+1] - lo[y];
+        int id = -1;
+        if(px-1 < -1 || p[px] < p[px-1]) id = 0;
+        if(px+1 <= bw && p[px+1] < p[px+id]) id = 1;
+        if(p[px+id] >= PAD) return false;
+        seam[y] = lo[y] + px + id;
+    }
+    return true;
+}
+
+// GlM[̃s~bh̍łeiŌseam߁A1iׂi
+// т̒ŏCĂBłׂi̓Iv@ O(height * band) ōςށB
+// т̒ŌȂíA̒iŜ̓Iv@ɐ؂ւB
+// s~bh͌Ăяo܂ŎA߂seamcarveSeamupdateEdgeō
+// Ƃ̎̌Ăяoł́Aesseam̍ (updateEdgeXV͈) E
+// 蒼Bdirty͂̂߂̊es̗ŁAŏ̌Ăяoł͋ɂĂB
+void computeSeamPyramid(cv::Mat& edge, vector<cv::Mat>& pyramid, vector<int>& dirty, vector<int>& seam) {
+    // i߂ (iςƂ͑Ŝ蒼)
+    int top = 0;
+    int w = edge.cols, h = edge.rows;
+    while(top < pyramidLevels && w >= 2 * pyramidMinSize && h >= 2 * pyramidMinSize) {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        top++;
+    }
+    if((int)pyramid.size() != top + 1) {
+        pyramid.resize(top + 1);
+        dirty.clear();
+    }
+    pyramid[0] = edge;
+    for(int l=1; l<=top; l++) {
+        downsampleEnergy(pyramid[l-1], pyramid[l], dirty);
+    }
+
+    computeSeam(pyramid[top], seam);
+    vector<int> coarse;
+    for(int l=top-1; l>=0; l--) {
+        coarse.swap(seam);
+        if(!refineSeam(pyramid[l], coarse, seamBand, seam)) {
+            computeSeam(pyramid[l], seam);
+        }
+    }
+
+    dirty.resize(edge.rows);
+    for(int y=0; y<edge.rows; y++) {
+        dirty[y] = max(0, seam[y] - 3);
+    }
+}
+
+// 1̓Iv@A݂ɌȂGlM[̏seamők{߂
+// [̗ݐσGlM[ɃobNgbNAقseamgf
+// قseamƌ΂߂̈ړ͔BGlM[ŏseam(1+slack){
+// seam͍̗pȂ̂ŁA1{ꍇ̕i̒ቺ͈͂̔͂ɗ}B
+// seams͍珇ɕׂĕԂ (ǂ̍słԂɂȂ)B
+void computeSeams(cv::Mat& edge, int k, double slack, vector<vector<int> >& seams) {
+    const int width  = edge.cols;
+    const int height = edge.rows;
+
+    cv::Mat table;
+    cumulativeEnergy(edge, table);
+
+    // [̗ݐσGlM[
+    vector<pair<int, int> > ends(width);
+    for(int x=0; x<width; x++) {
+        ends[x] = make_pair(table.at<int>(height-1, x+1), x);
+    }
+    sort(ends.begin(), ends.end());
+
+    // efgĂseam̔ԍ (-1͖gpAEɔԕ)
+    cv::Mat label = cv::Mat(height, width+2, CV_32SC1, cv::Scalar(-1));
+    for(int y=0; y<height; y++) {
+        label.at<int>(y, 0)       = INT_MAX;
+        label.at<int>(y, width+1) = INT_MAX;
+    }
+
+    seams.clear();
+    vector<int> seam(height);
+    double limit = 0.0;
+    for(int i=0; i<width && (int)seams.size()<k; i++) {
+        const int id = (int)seams.size();
+        int cur_x = ends[i].second;
+        if(label.at<int>(height-1, cur_x+1) != -1) continue;
+
+        // 󂢂Ă3ߖT̂ݐσGlM[ŏ̉fǂ
+        bool found = true;
+        int energy = edge.at<uchar>(height-1, cur_x);
+        seam[height-1] = cur_x;
+        for(int y=height-2; y>=0 && found; y--) {
+            const int* p = table.ptr<int>(y) + 1;
+            const int* l = label.ptr<int>(y) + 1;
+            const int* lb = label.ptr<int>(y+1) + 1;
+            int best = -2;
+            for(int dx=-1; dx<=1; dx++) {
+                if(l[cur_x+dx] != -1) continue;
+                if(dx != 0 && l[cur_x] != -1 && l[cur_x] == lb[cur_x+dx]) continue;
+                if(best == -2 || p[cur_x+dx] < p[cur_x+best]) best = dx;
+            }
+            if(best == -2) {
+                found = false;
+            } else {
+                cur_x += best;
+                seam[y] = cur_x;
+                energy += edge.at<uchar>(y, cur_x);
+            }
+        }
+        if(!found) continue;
+
+        // ŏ(ŏ)seam̃GlM[߂
+        if(id == 0) {
+            limit = (1.0 + slack) * energy;
+        } else if(energy > limit) {
+            break;
+        }
+
+        for(int y=0; y<height; y++) {
+            label.at<int>(y, seam[y]+1) = id;
+        }
+        seams.push_back(seam);
+    }
+
+    // 珇ɕׂ
+    sort(seams.begin(), seams.end());
+}
+
+// seam菜
+// s̃XgCh͂̂܂܂ŁAesseamEmemmove1fɋl߁A
+// 1炵wb_ɍւ (seamƂ̊mۂ摜Ŝ̃Rs[͂Ȃ)B
+// 摜AGbWACfbNXȂǕ̉摜1̕񏈗ł܂Ƃ߂čB
+void carveSeam(vector<cv::Mat*>& planes, vector<int>& seam) {
+    const int height = planes[0]->rows;
+    const int nplane = (int)planes.size();
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int y=0; y<height; y++) {
+        for(int i=0; i<nplane; i++) {
+            cv::Mat& m = *planes[i];
+            const size_t esz = m.elemSize();
+            uchar* row = m.ptr(y);
+            memmove(row + seam[y]*esz, row + (seam[y]+1)*esz, (m.cols - 1 - seam[y]) * esz);
+        }
+    }
+
+    for(int i=0; i<nplane; i++) {
+        cv::Mat& m = *planes[i];
+        m = m(cv::Rect(0, 0, m.cols-1, m.rows));
+    }
+}
+
+// 1ɂȂ܂seamAefԖڂseamōꂽL^
+// (Ō܂Ŏcf width-1)B̏ԂCӂ̉̉摜B
+// Ԃ16bitŎ̂ŁA65536ȉł邱ƁB
+void computeSeamOrder(cv::Mat& img, cv::Mat& order) {
+    const int width  = img.cols;
+    const int height = img.rows;
+
+    cv::Mat out, gray, edge;
+    cv::Mat idx = cv::Mat(height, width, CV_32SC1);
+    for(int y=0; y<height; y++) {
+        for(int x=0; x<width; x++) {
+            idx.at<int>(y, x) = x;
+        }
+    }
 
-    int cur_y = height-1;
-    while(cur_y >= 0) {
-        seam[cur_y] = cur_x;
-        cur_x = cur_x + prev.at<int>(cur_y, cur_x);
-        cur_y--;
+    img.convertTo(out, CV_8U);
+    cv::cvtColor(out, gray, CV_BGR2GRAY);
+    detectEdge(out, edge);
+    vector<cv::Mat*> planes;
+    planes.push_back(&idx);
+    planes.push_back(&gray);
+    planes.push_back(&edge);
+
+    order = cv::Mat(height, width, CV_16UC1);
+    vector<int> seam;
+    for(int i=0; i<width-1; i++) {
+        computeSeam(edge, seam);
+        for(int y=0; y<height; y++) {
+            order.at<ushort>(y, idx.at<int>(y, seam[y])) = i;
+        }
+        carveSeam(planes, seam);
+        updateEdge(gray, edge, seam);
+        printf("%5d / %5d seams are computed\r", i+1, width-1);
+    }
+    printf("\n");
+
+    for(int y=0; y<height; y++) {
+        order.at<ushort>(y, idx.at<int>(y, 0)) = width-1;
     }
 }
 
-template <class T>
-void carveSeam(cv::Mat& img, vector<int>& seam) {
+// seam̏Ԃ牡target̉摜1pXō
+// k͐ɍꂽ (width - target) {seamA
+// g͐ɍ (target - width) {seam2񂸂ׂ
+void retarget(cv::Mat& img, cv::Mat& order, int target, cv::Mat& out) {
     const int width  = img.cols;
     const int height = img.rows;
     const int dim    = img.channels();
-    const int depth  = img.depth();
+    const int remove = width - target;
+    const int dup    = target - width;
+
+    out = cv::Mat(height, target, img.type());
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for(int y=0; y<height; y++) {
+        const uchar*  src = img.ptr<uchar>(y);
+        const ushort* o   = order.ptr<ushort>(y);
+        uchar* dst = out.ptr<uchar>(y);
+        for(int x=0; x<width; x++) {
+            int n = 1;
+            if(remove > 0 && o[x] < remove) n = 0;
+            if(dup > 0 && o[x] < dup) n = 2;
+            for(int k=0; k<n; k++) {
+                for(int c=0; c<dim; c++) {
+                    *dst++ = src[x*dim+c];
+                }
+            }
+        }
+    }
+}
 
-    cv::Mat tmp = cv::Mat(height, width-1, CV_MAKETYPE(depth, dim));
+// 珇ɕ񂾌݂ɌȂseam܂Ƃ߂Ď菜A
+// seam̎̃GbWXV
+void carveSeams(vector<cv::Mat*>& planes, vector<vector<int> >& seams, cv::Mat& gray, cv::Mat& edge) {
+    const int height = planes[0]->rows;
+    const int nplane = (int)planes.size();
+    const int k      = (int)seams.size();
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
     for(int y=0; y<height; y++) {
-        for(int x=0; x<width-1; x++) {
-            int xx = (x < seam[y]) ? x : x+1;
-            for(int c=0; c<dim; c++) {         
-                tmp.at<T>(y, x*dim+c) = img.at<T>(y, xx*dim+c);
+        for(int i=0; i<nplane; i++) {
+            cv::Mat& m = *planes[i];
+            const size_t esz = m.elemSize();
+            uchar* row = m.ptr(y);
+            int dst = seams[0][y];
+            for(int j=0; j<k; j++) {
+                int begin = seams[j][y] + 1;
+                int end   = j+1 < k ? seams[j+1][y] : m.cols;
+                memmove(row + dst*esz, row + begin*esz, (end - begin) * esz);
+                dst += end - begin;
+            }
+        }
+    }
+
+    for(int i=0; i<nplane; i++) {
+        cv::Mat& m = *planes[i];
+        m = m(cv::Rect(0, 0, m.cols-k, m.rows));
+    }
+
+    // jԖڂseaḿẢ摜ł j fɂꂽʒǔԂɂȂ
+    vector<int> gap(height);
+    for(int j=0; j<k; j++) {
+        for(int y=0; y<height; y++) {
+            gap[y] = seams[j][y] - j;
+        }
+        updateEdge(gray, edge, gap);
+    }
+}
+
+// 1̓Iv@k{seamnpixfk
+// ߂l͍f̃GlM[̍v (i̔rp)
+long long shrinkBatch(cv::Mat& img, cv::Mat& out, int npix, int k, bool show) {
+    cv::Mat gray, edge;
+    img.convertTo(out, CV_8U);
+    cv::cvtColor(out, gray, CV_BGR2GRAY);
+    detectEdge(out, edge);
+    vector<cv::Mat*> planes;
+    planes.push_back(&out);
+    planes.push_back(&gray);
+    planes.push_back(&edge);
+
+    long long energy = 0;
+    int removed = 0;
+    vector<vector<int> > seams;
+    while(removed < npix) {
+        computeSeams(edge, min(k, npix - removed), batchSlack, seams);
+        for(int j=0; j<(int)seams.size(); j++) {
+            for(int y=0; y<edge.rows; y++) {
+                energy += edge.at<uchar>(y, seams[j][y]);
             }
         }
+        carveSeams(planes, seams, gray, edge);
+        removed += (int)seams.size();
+
+        if(show) {
+            cv::imshow("output", out);
+            cv::waitKey(30);
+            printf("%3d seams are carved!\r", removed);
+        }
+    }
+    if(show) printf("\n");
+    return energy;
+}
+
+// k = 1, 4, 16, 64 ̑xƕi (f̃GlM[̍v) r
+// k = 1 1{錵ȕ@Ɠ
+void benchmarkBatch(cv::Mat& img) {
+    const int ks[4] = { 1, 4, 16, 64 };
+    double    base_time   = 0.0;
+    long long base_energy = 0;
+    printf("    k     time  speedup      energy   ratio\n");
+    for(int i=0; i<4; i++) {
+        cv::Mat out;
+        int64 t = cv::getTickCount();
+        long long energy = shrinkBatch(img, out, npix, ks[i], false);
+        double sec = (cv::getTickCount() - t) / cv::getTickFrequency();
+        if(i == 0) {
+            base_time   = sec;
+            base_energy = max(energy, 1LL);
+        }
+        printf("  %3d  %6.3fs  %6.2fx  %10lld  %6.3f\n", ks[i], sec, base_time / sec, energy, (double)energy / base_energy);
     }
-    tmp.convertTo(img, depth);
 }
 
 void enlarge(cv::InputArray I, cv::OutputArray O, cv::Mat& seam) {
@@ -179,20 +658,31 @@ int main(int argc, char** argv) {
 
 	// Carving̎s
     cv::Mat out;
-    if(mode == 1) {
+    if(mode == 1 || mode == 6) {
 	    cv::namedWindow("output");	
-        cv::Mat edge;
-        vector<int> seam;
+        cv::Mat gray, edge;
+        vector<int> seam, dirty;
+        vector<cv::Mat> pyramid;
         img.convertTo(out, CV_8U);
-	    for(int i=0; i<npix; i++) {
-            // GbW𒊏o
-            detectEdge(out, edge);
 
-            // seam̌vZ
-            computeSeam(edge, seam);
+        // GbW͍ŏɈxoAȍ~͉摜ƈꏏcarve
+        cv::cvtColor(out, gray, CV_BGR2GRAY);
+        detectEdge(out, edge);
+        vector<cv::Mat*> planes;
+        planes.push_back(&out);
+        planes.push_back(&gray);
+        planes.push_back(&edge);
+	    for(int i=0; i<npix; i++) {
+            // seam̌vZ ([h6ł̓s~bhőeiT)
+            if(mode == 6) {
+                computeSeamPyramid(edge, pyramid, dirty, seam);
+            } else {
+                computeSeam(edge, seam);
+            }
 		
-		    // seamcarve
-            carveSeam<uchar>(out, seam);
+		    // seamcarveāAseam̎̃GbWXV
+            carveSeam(planes, seam);
+            updateEdge(gray, edge, seam);
 		
 		    // 摜̍XV
 		    cv::imshow("output", out);
@@ -201,6 +691,34 @@ int main(int argc, char** argv) {
 	    }
        	printf("\n");
     }
+    else if(mode == 4) {
+	    cv::namedWindow("output");	
+        shrinkBatch(img, out, npix, nbatch, true);
+    }
+    else if(mode == 5) {
+        benchmarkBatch(img);
+        return 0;
+    }
+    else if(mode == 3) {
+        // seam̏Ԃ͉摜ׂ̗ɕۑĂA2ڈȍ~͓ǂݍނɂ
+        if(npix < 1 || npix > 2 * width) {
+            printf("target width must be in [1, %d]\n", 2 * width);
+            return -1;
+        }
+        if(width > 65536) {
+            printf("seam index map stores 16 bit indices, so width must be at most 65536\n");
+            return -1;
+        }
+
+        string mapfile = string(argv[1]) + ".seams.png";
+        cv::Mat order = cv::imread(mapfile, CV_LOAD_IMAGE_UNCHANGED);
+        if(order.empty() || order.size() != img.size() || order.type() != CV_16UC1) {
+            computeSeamOrder(img, order);
+            cv::imwrite(mapfile, order);
+            printf("seam index map is saved to \"%s\"\n", mapfile.c_str());
+        }
+        retarget(img, order, npix, out);
+    }
     else {
         cv::Mat idx = cv::Mat(height, width, CV_32SC2);
         for(int y=0; y<height; y++) {
@@ -210,19 +728,23 @@ int main(int argc, char** argv) {
             }
         }
 
-        cv::Mat edge;
+        cv::Mat gray, edge;
         vector<int> seam;
         img.convertTo(out, CV_8U);
+        cv::cvtColor(out, gray, CV_BGR2GRAY);
+        detectEdge(out, edge);
+        vector<cv::Mat*> planes;
+        planes.push_back(&out);
+        planes.push_back(&idx);
+        planes.push_back(&gray);
+        planes.push_back(&edge);
 	    for(int i=0; i<npix; i++) {
-            // GbW𒊏o
-            detectEdge(out, edge);
-
             // seam̌vZ
             computeSeam(edge, seam);
 		
 		    // seamcarve
-            carveSeam<uchar>(out, seam);
-            carveSeam<int>(idx, seam);		
+            carveSeam(planes, seam);
+            updateEdge(gray, edge, seam);
 	    }
 
         // Ăseamۑ